@@ -1,41 +1,59 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
 #include <stdint.h>
 #include <stdbool.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <omp.h>
 #include <unistd.h>
 #include <time.h>
 #include <map>
 #include <vector>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
 #define N 1000000
-#define MIN_DELAY 1
-#define MAX_DELAY 24
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+#define PARK_SPINS 128
+#define WAKE_ROUNDS 1000
+#define WAKE_GAP 200
+#define WAKE_TIMEOUT 1e-3
 #define AVG_TIMES 20
+#define RECYCLE_ROUNDS 10
+#define CACHE_LINE 64
+#define SLAB_NODES 1024
+#define SLAB_BATCH 64
+#define ALLOC_ROUNDS 10
 
 int thread_number;
+int backoff_method;
 map<int, int> correct_check;
 vector<int> *correct_thread;
 
 /////////////////////////////////////////////////////
 /* structure definition */
 
-struct Node;
-struct Pointer;
-typedef struct Node Node;
-typedef struct Pointer Pointer;
+template <typename T> struct Node;
 
+template <typename T>
 struct Pointer {
-	Node *data;
+	Node<T> *data;
 	unsigned long tag;
 	Pointer () {
 		data = NULL;
 		tag = 0;
 	}
 
-	Pointer(Node *node, unsigned int version_number) {  
+	Pointer(Node<T> *node, unsigned int version_number) {  
 		data = node; 
 		tag = version_number;  
 	}  
@@ -51,18 +69,90 @@ struct Pointer {
 }__attribute__((aligned(16)));
 
 
+// released counts the two owners of a node, the dequeuer that moves its
+// value out and the one that unlinks it as the dummy; the second one
+// recycles it. The queue marks its first dummy, which never held a
+// value, as released once itself.
+template <typename T>
 struct Node {
-	int value;
-	Pointer next;
-	Node () {
-		value = 0;
+	T value;
+	volatile int released;
+	Pointer<T> next;
+	Node () : value() {
+		released = 0;
+	}
+
+	// the value is built in place from whatever enqueue was given
+	template <typename... Args>
+	Node (Args&&... args) : value(std::forward<Args>(args)...) {
+		released = 0;
 	}
 };
 
+// a cache-line sized payload for test_generic
+typedef struct Message {
+	int id;
+	char payload[60];
+} Message;
+
+// a payload that counts how many of it are alive, for test_destroy
+struct Counted {
+	static volatile int live;
+	int id;
+
+	Counted () {
+		id = 0;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted (int i) {
+		id = i;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted (const Counted &other) {
+		id = other.id;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted & operator= (const Counted &other) {
+		id = other.id;
+		return *this;
+	}
+
+	~Counted () {
+		__sync_fetch_and_sub(&live, 1);
+	}
+};
+
+volatile int Counted::live = 0;
+
 
 /////////////////////////////////////////////////////
 /* global inline function */
 
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+// the shared Pointers are plain fields: without this the compiler may load
+// one again instead of using the copy, or load through it ahead of the copy
+inline static void compiler_barrier () {
+	__asm__ __volatile__("" ::: "memory");
+}
+
+inline static long futex_wait (volatile int *addr, int val, const struct timespec *timeout = NULL) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+inline static long futex_wake (volatile int *addr, int count) {
+	return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
 inline static bool CAS_ASM_64(volatile uint64_t target[2], uint64_t compare[2], uint64_t set[2]) {
 	bool z;
 	__asm__ __volatile__("movq 0(%4), %%rax;"
@@ -102,87 +192,444 @@ inline static bool CAS2(void *t, void *c, void *s) {
 /////////////////////////////////////////////////////
 /* global function */
 
-void backoff () {
-	static int limit = MIN_DELAY;
-	int delay = rand()%limit*100;
-	limit = min(MAX_DELAY, 2*limit);
-	usleep(delay);
+// bytes per slab slot: small nodes get a power of two share of a cache
+// line and bigger ones whole lines, so no node straddles two of them
+constexpr size_t slab_slot (size_t size, size_t slot = sizeof(void *)) {
+	return slot >= size ? slot : (slot >= CACHE_LINE ? (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE : slab_slot(size, slot*2));
 }
 
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
 /////////////////////////////////////////////////////
 /* class definition */
 
+// per-thread slab allocator for the nodes of one value type, shared by
+// every container of that type. A thread carves nodes out of its own
+// chunk of SLAB_NODES slots and keeps the nodes it frees on its own list,
+// whoever allocated them; once that list holds 2*SLAB_BATCH nodes,
+// SLAB_BATCH of them go to the shared depot in one go, and a thread whose
+// chunk ran out takes a whole batch back before it carves a new one.
+// Chunks live as long as the process and next is built only once, so a
+// stale reader of next always reads some node, and every reuse counts up
+// the tag of next so a stale CAS2 on it fails. Only the value is
+// destroyed on recycle and built again on reuse.
+template <typename T>
+class NodeSlab {
+	private:
+		// plain data, so it needs no constructor and no destructor
+		typedef struct Cache {
+			Node<T> *free_nodes;
+			int count;
+			char *cursor;
+			char *end;
+		} Cache;
+
+		typedef struct Depot {
+			// heads of NULL terminated batches
+			vector<Node<T> *> batches;
+			vector<char *> chunks;
+			volatile int lock;
+			Depot () {
+				lock = 0;
+			}
+		} Depot;
+
+		static thread_local Cache cache;
+
+		static Depot * depot () {
+			static Depot *shared = new Depot();
+			return shared;
+		}
+
+		static void lock (Depot *shared) {
+			while (__sync_lock_test_and_set(&shared->lock, 1)) {
+				cpu_relax();
+			}
+		}
+
+		static void unlock (Depot *shared) {
+			__sync_lock_release(&shared->lock);
+		}
+
+		// only once the chunk is used up, so carving stays lock free
+		static bool take_batch (Cache *local) {
+			if (local->cursor != local->end) {
+				return false;
+			}
+			Depot *shared = depot();
+			lock(shared);
+			if (shared->batches.empty()) {
+				unlock(shared);
+				return false;
+			}
+			local->free_nodes = shared->batches.back();
+			local->count = SLAB_BATCH;
+			shared->batches.pop_back();
+			unlock(shared);
+			return true;
+		}
+
+		static void * carve (Cache *local) {
+			if (local->cursor == local->end) {
+				Depot *shared = depot();
+				local->cursor = (char *)aligned_alloc(CACHE_LINE, SLAB_NODES*slab_slot(sizeof(Node<T>)));
+				local->end = local->cursor + SLAB_NODES*slab_slot(sizeof(Node<T>));
+				lock(shared);
+				shared->chunks.push_back(local->cursor);
+				unlock(shared);
+			}
+			void *node = local->cursor;
+			local->cursor += slab_slot(sizeof(Node<T>));
+			return node;
+		}
+
+		static void spill (Cache *local) {
+			Node<T> *first = local->free_nodes;
+			Node<T> *last = first;
+			for (int i = 1;i < SLAB_BATCH;i++) {
+				last = last->next.data;
+			}
+			local->free_nodes = last->next.data;
+			last->next = Pointer<T>(NULL, last->next.tag+1);
+			local->count -= SLAB_BATCH;
+			Depot *shared = depot();
+			lock(shared);
+			shared->batches.push_back(first);
+			unlock(shared);
+		}
+	public:
+		template <typename... Args>
+		static Node<T> * alloc (Args&&... args) {
+			Cache *local = &cache;
+			if (local->free_nodes == NULL && !take_batch(local)) {
+				return new (carve(local)) Node<T>(std::forward<Args>(args)...);
+			}
+			Node<T> *node = local->free_nodes;
+			local->free_nodes = node->next.data;
+			local->count--;
+			new (&node->value) T(std::forward<Args>(args)...);
+			node->released = 0;
+			node->next = Pointer<T>(NULL, node->next.tag+1);
+			return node;
+		}
+
+		static void recycle (Node<T> *node) {
+			Cache *local = &cache;
+			node->value.~T();
+			node->next = Pointer<T>(local->free_nodes, node->next.tag+1);
+			local->free_nodes = node;
+			if (++local->count >= 2*SLAB_BATCH) {
+				spill(local);
+			}
+		}
+
+		static long chunks () {
+			Depot *shared = depot();
+			lock(shared);
+			long count = shared->chunks.size();
+			unlock(shared);
+			return count;
+		}
+};
+
+template <typename T>
+thread_local typename NodeSlab<T>::Cache NodeSlab<T>::cache;
+
+template <typename T>
 class QueueWithTag {
 	private:
-		Pointer head;
-		Pointer tail;
+		int backoff;
+		Pointer<T> head;
+		Pointer<T> tail;
+		volatile int waiters;
+		volatile int wake_seq;
+
+		// the successful enqueue CAS is a full barrier, so reading waiters
+		// after it cannot miss a consumer that registered before its recheck
+		void wake_waiters (int count) {
+			if (waiters > 0) {
+				__sync_fetch_and_add(&wake_seq, 1);
+				futex_wake(&wake_seq, count);
+			}
+		}
+
+		void release (Node<T> *node) {
+			if (__sync_add_and_fetch(&node->released, 1) == 2) {
+				NodeSlab<T>::recycle(node);
+			}
+		}
 	public:
 
 		QueueWithTag () {
-			Node *vnode = new Node();
-			vnode->next = Pointer(NULL, 0);
-			head = Pointer(vnode, 0);
-			tail = Pointer(vnode, 0);
+			backoff = backoff_method;
+			Node<T> *vnode = NodeSlab<T>::alloc();
+			vnode->released = 1;
+			head = Pointer<T>(vnode, 0);
+			tail = Pointer<T>(vnode, 0);
+			waiters = 0;
+			wake_seq = 0;
+		}
+
+		// recycle() also destroys the values nobody took out
+		~QueueWithTag () {
+			Node<T> *cur = head.data;
+			while (cur != NULL) {
+				Node<T> *next = cur->next.data;
+				NodeSlab<T>::recycle(cur);
+				cur = next;
+			}
+		}
+
+		void set_backoff (int method) {
+			backoff = method;
 		}
 
-		void enqueue (int val) {
-			Pointer old_tail, old_next;  
-			Node *data = new Node();  
-			data->value = val;  
+		template <typename... Args>
+		void emplace (Args&&... args) {
+			Backoff bo(backoff);
+			Pointer<T> old_tail, old_next;  
+			Node<T> *data = NodeSlab<T>::alloc(std::forward<Args>(args)...);  
 			while(true){  
 				old_tail = tail;   
+				compiler_barrier();
 				old_next = old_tail.data->next;  
+				compiler_barrier();
 				if (old_tail == tail) {  
 					if(old_next.data == NULL) {  
-						Pointer new_pt(data, old_next.tag+1);  
-						if(CAS2(&(tail.data->next), &old_next, &new_pt)){  
-							Pointer new_pt(data, old_tail.tag+1); 
-							tail = new_pt;
+						Pointer<T> new_pt(data, old_next.tag+1);  
+						if(CAS2(&(old_tail.data->next), &old_next, &new_pt)){  
 							break;
 						}  
 					} else {  
-						Pointer new_pt(old_next.data, old_tail.tag+1);  
+						Pointer<T> new_pt(old_next.data, old_tail.tag+1);  
 						CAS2(&tail, &old_tail, &new_pt);   
 					}
 				}  
-				backoff();
+				bo.wait();
 			}  
-			//Pointer new_pt(data, old_tail.tag+1);  
-			//CAS2(&tail, &old_tail, &new_pt); 
+			// a plain store could move tail back onto a node that has
+			// since been dequeued and recycled
+			Pointer<T> new_pt(data, old_tail.tag+1);  
+			CAS2(&tail, &old_tail, &new_pt); 
+			wake_waiters(1);
 		}
 
-		
-		Node * dequeue() {    
-			Pointer old_tail, old_head, old_next;  
-			Node *data = NULL;
+		void enqueue (T val) {
+			emplace(std::move(val));
+		}
+
+		// the new head keeps its node as the dummy, but only the thread whose
+		// CAS installed it ever touches its value, so it is moved out after.
+		// Both nodes are then released: the old head as unlinked, the new
+		// one as consumed.
+		bool dequeue (T *out) {    
+			Backoff bo(backoff);
+			Pointer<T> old_tail, old_head, old_next;  
+			Node<T> *data = NULL;
 
 			while(true){   
 				old_head = head;   
 				old_tail = tail;   
+				compiler_barrier();
 				old_next = (old_head.data)->next;   
+				compiler_barrier();
 				if (old_head != head) {
-					backoff();
+					bo.wait();
 					continue;
 				}   
   
 				if(old_head.data == old_tail.data){  
 					if (old_next.data == NULL){   
-						return NULL;  
+						return false;  
 					}  
-					Pointer new_pt(old_next.data, old_tail.tag+1);  
+					Pointer<T> new_pt(old_next.data, old_tail.tag+1);  
 					CAS2(&tail, &old_tail, &new_pt);  
 				} else{   
 					data = old_next.data;  
-					Pointer new_pt(old_next.data, old_head.tag+1);  
+					Pointer<T> new_pt(old_next.data, old_head.tag+1);  
 					if(CAS2(&head, &old_head, &new_pt)){  
 						break;  
 					}  
 				}  
-				backoff();
+				bo.wait();
 			}  
-			//delete old_head.data;  
-			return data;  
+			*out = std::move(data->value);
+			release(old_head.data);
+			release(data);
+			return true;  
 		} 
+
+		// dequeue that waits for an item: spin for a while, then register as
+		// a waiter, recheck and sleep on wake_seq. A negative timeout waits
+		// forever; on timeout the result is false as with dequeue.
+		bool dequeue_for (T *out, double timeout) {
+			double deadline = omp_get_wtime() + timeout;
+			while (true) {
+				for (int i = 0;i < PARK_SPINS;i++) {
+					if (dequeue(out)) {
+						return true;
+					}
+					cpu_relax();
+				}
+				int seq = wake_seq;
+				__sync_fetch_and_add(&waiters, 1);
+				bool found = dequeue(out);
+				if (!found) {
+					struct timespec ts, *tp = NULL;
+					if (timeout >= 0) {
+						double left = deadline - omp_get_wtime();
+						if (left <= 0) {
+							__sync_fetch_and_sub(&waiters, 1);
+							return false;
+						}
+						ts.tv_sec = (time_t)left;
+						ts.tv_nsec = (long)((left-ts.tv_sec)*1e9);
+						tp = &ts;
+					}
+					futex_wait(&wake_seq, seq, tp);
+				}
+				__sync_fetch_and_sub(&waiters, 1);
+				if (found) {
+					return true;
+				}
+			}
+		}
+
+		void dequeue_wait (T *out) {
+			dequeue_for(out, -1);
+		}
+
+		// link the batch privately, then splice it in with one CAS on the
+		// last node's next; tail is swung to the end of the batch after.
+		// The values are moved out of vals.
+		void enqueue_bulk (T *vals, int count) {
+			if (count <= 0) {
+				return ;
+			}
+			Backoff bo(backoff);
+			Node<T> *first = NodeSlab<T>::alloc(std::move(vals[0]));
+			Node<T> *last = first;
+			for (int i = 1;i < count;i++) {
+				Node<T> *data = NodeSlab<T>::alloc(std::move(vals[i]));
+				last->next = Pointer<T>(data, last->next.tag+1);
+				last = data;
+			}
+			Pointer<T> old_tail, old_next;
+			while (true) {
+				old_tail = tail;
+				compiler_barrier();
+				old_next = old_tail.data->next;
+				compiler_barrier();
+				if (old_tail == tail) {
+					if (old_next.data == NULL) {
+						Pointer<T> new_pt(first, old_next.tag+1);
+						if (CAS2(&(old_tail.data->next), &old_next, &new_pt)) {
+							break;
+						}
+					} else {
+						Pointer<T> new_pt(old_next.data, old_tail.tag+1);
+						CAS2(&tail, &old_tail, &new_pt);
+					}
+				}
+				bo.wait();
+			}
+			Pointer<T> new_pt(last, old_tail.tag+1);
+			CAS2(&tail, &old_tail, &new_pt);
+			wake_waiters(count);
+		}
+
+		// up to k values with one CAS on head, returns how many; the values
+		// are moved out once the CAS has made the nodes ours, and each node
+		// is released after its successor has been read
+		int dequeue_bulk (T *vals, int k) {
+			Backoff bo(backoff);
+			Pointer<T> old_head, old_tail;
+			while (true) {
+				old_head = head;
+				old_tail = tail;
+				compiler_barrier();
+				Node<T> *last = old_head.data;
+				int count = 0;
+				bool behind_tail = false;
+				while (count < k) {
+					Node<T> *next = last->next.data;
+					if (next == NULL) {
+						break;
+					}
+					// never move head past a lagging tail
+					if (last == old_tail.data) {
+						behind_tail = true;
+						break;
+					}
+					count++;
+					last = next;
+				}
+				compiler_barrier();
+				if (old_head != head) {
+					bo.wait();
+					continue;
+				}
+				if (behind_tail) {
+					Pointer<T> new_pt(old_tail.data->next.data, old_tail.tag+1);
+					CAS2(&tail, &old_tail, &new_pt);
+					continue;
+				}
+				if (count == 0) {
+					return 0;
+				}
+				Pointer<T> new_pt(last, old_head.tag+1);
+				if (CAS2(&head, &old_head, &new_pt)) {
+					Node<T> *cur = old_head.data;
+					for (int i = 0;i < count;i++) {
+						Node<T> *next = cur->next.data;
+						vals[i] = std::move(next->value);
+						release(cur);
+						release(next);
+						cur = next;
+					}
+					return count;
+				}
+				bo.wait();
+			}
+		}
 		
 };
 
@@ -191,7 +638,7 @@ class QueueWithTag {
 
 void test_time () {
 	double tstart = 0.0, ttaken = 0.0;
-	QueueWithTag q_lock_free_tag;
+	QueueWithTag<int> q_lock_free_tag;
 	tstart = omp_get_wtime();
 
 	# pragma omp parallel for 
@@ -208,14 +655,15 @@ void test_time () {
 	tstart = omp_get_wtime();
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		q_lock_free_tag.dequeue();
+		int val;
+		q_lock_free_tag.dequeue(&val);
 	}
 	ttaken = omp_get_wtime() - tstart;
 	cout << "dequeue time: " << ttaken << endl;
 }
 
 void test_enqueue_correct () {
-	QueueWithTag q_lock_free_tag;
+	QueueWithTag<int> q_lock_free_tag;
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		q_lock_free_tag.enqueue(i);
@@ -223,19 +671,19 @@ void test_enqueue_correct () {
 
 	int count = 0;
 	for (int i = 1;i <= N;i++) {
-		Node *pop_val = q_lock_free_tag.dequeue();
-		if (pop_val == NULL) {
+		int pop_val;
+		if (!q_lock_free_tag.dequeue(&pop_val)) {
 			break;
 		}
 		count++;
 		
-		if (correct_check[pop_val->value] == 0) {
+		if (correct_check[pop_val] == 0) {
 			cout << "Unseen variable" << endl;
 			return ;
 		}
 		
-		correct_check[pop_val->value]--;
-		if (correct_check[pop_val->value] < 0) {
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
 			cout << "Multiple variable" << endl;
 			return ;
 		}
@@ -250,7 +698,7 @@ void test_enqueue_correct () {
 }
 
 void test_dequeue_correct () {
-	QueueWithTag q_lock_free_tag;
+	QueueWithTag<int> q_lock_free_tag;
 	for (int i = 1;i <= N;i++) {
 		q_lock_free_tag.enqueue(i);
 	}
@@ -259,8 +707,9 @@ void test_dequeue_correct () {
 
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		Node *data = q_lock_free_tag.dequeue();
-		correct_thread[omp_get_thread_num()].push_back(data->value);
+		int data;
+		q_lock_free_tag.dequeue(&data);
+		correct_thread[omp_get_thread_num()].push_back(data);
 	}
 	
 	int count = 0;
@@ -289,8 +738,284 @@ void test_dequeue_correct () {
 }
 
 
+// the same workload as test_time once for every backoff strategy
+void test_backoff () {
+	const char *names[] = {"none", "exponential", "proportional"};
+	for (int method = BACKOFF_NONE;method <= BACKOFF_PROP;method++) {
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		QueueWithTag<int> q_lock_free_tag;
+		q_lock_free_tag.set_backoff(method);
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			q_lock_free_tag.enqueue(i);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			q_lock_free_tag.dequeue(&val);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << names[method] << " backoff, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+}
+
+// enqueue_bulk/dequeue_bulk over a range of batch sizes
+void test_bulk () {
+	int batch_sizes[] = {1, 4, 16, 64, 256};
+	for (int b = 0;b < 5;b++) {
+		int batch = batch_sizes[b];
+		int batches = (N+batch-1)/batch;
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		QueueWithTag<int> q_lock_free_tag;
+		for (int i = 0;i < thread_number;i++) {
+			correct_thread[i].clear();
+		}
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int j = 0;j < batches;j++) {
+			int vals[256];
+			int count = min(batch, N-j*batch);
+			for (int i = 0;i < count;i++) {
+				vals[i] = j*batch+i+1;
+			}
+			q_lock_free_tag.enqueue_bulk(vals, count);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel 
+		{
+			int vals[256];
+			int count;
+			while ((count = q_lock_free_tag.dequeue_bulk(vals, batch)) > 0) {
+				for (int i = 0;i < count;i++) {
+					correct_thread[omp_get_thread_num()].push_back(vals[i]);
+				}
+			}
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "batch " << batch << " , enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+
+		vector<int> seen(N+1, 0);
+		int total = 0;
+		for (int i = 0;i < thread_number;i++) {
+			for (size_t j = 0;j < correct_thread[i].size();j++) {
+				total++;
+				if (seen[correct_thread[i][j]]++ != 0) {
+					cout << "Multiple variable" << endl;
+					return ;
+				}
+			}
+		}
+		if (total != N) {
+			cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+			return ;
+		}
+	}
+	cout << "Bulk Correct" << endl;
+}
+
+// one producer, the other threads consume either by polling dequeue or
+// by parking in dequeue_for; reports wake-up latency and CPU time per
+// wall-clock second
+void test_blocking () {
+	if (thread_number < 2) {
+		cout << "blocking test needs at least 2 threads" << endl;
+		return ;
+	}
+	const char *names[] = {"busy poll", "futex park"};
+	for (int park = 0;park <= 1;park++) {
+		QueueWithTag<int> q_lock_free_tag;
+		vector<double> sent(WAKE_ROUNDS), got(WAKE_ROUNDS);
+		volatile int received = 0;
+		struct rusage start_usage, end_usage;
+		getrusage(RUSAGE_SELF, &start_usage);
+		double tstart = omp_get_wtime();
+		# pragma omp parallel
+		{
+			if (omp_get_thread_num() == 0) {
+				for (int i = 0;i < WAKE_ROUNDS;i++) {
+					usleep(WAKE_GAP);
+					sent[i] = omp_get_wtime();
+					q_lock_free_tag.enqueue(i);
+				}
+			} else {
+				while (received < WAKE_ROUNDS) {
+					int data;
+					if (!(park ? q_lock_free_tag.dequeue_for(&data, WAKE_TIMEOUT) : q_lock_free_tag.dequeue(&data))) {
+						cpu_relax();
+						continue;
+					}
+					got[data] = omp_get_wtime();
+					__sync_fetch_and_add(&received, 1);
+				}
+			}
+		}
+		double wall = omp_get_wtime() - tstart;
+		getrusage(RUSAGE_SELF, &end_usage);
+		double cpu = (end_usage.ru_utime.tv_sec-start_usage.ru_utime.tv_sec) + (end_usage.ru_utime.tv_usec-start_usage.ru_utime.tv_usec)*1e-6
+			+ (end_usage.ru_stime.tv_sec-start_usage.ru_stime.tv_sec) + (end_usage.ru_stime.tv_usec-start_usage.ru_stime.tv_usec)*1e-6;
+		double latency = 0.0;
+		for (int i = 0;i < WAKE_ROUNDS;i++) {
+			latency += got[i] - sent[i];
+		}
+		cout << names[park] << ", avg wake-up latency: " << latency/WAKE_ROUNDS*1e6 << " us , cpu: " << cpu/wall << " cores" << endl;
+	}
+
+	QueueWithTag<int> q_lock_free_tag;
+	double tstart = omp_get_wtime();
+	int data;
+	bool found = q_lock_free_tag.dequeue_for(&data, WAKE_TIMEOUT);
+	cout << "empty dequeue_for(" << WAKE_TIMEOUT << ") returned " << (found ? "an item" : "nothing") << " after " << omp_get_wtime() - tstart << endl;
+}
+
+// the same code over a cache-line sized message and over a move-only
+// unique_ptr, which has to be moved in and out of the nodes
+void test_generic () {
+	double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+	{
+		QueueWithTag<Message> q_lock_free_tag;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg{};
+			msg.id = i;
+			q_lock_free_tag.enqueue(msg);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg;
+			q_lock_free_tag.dequeue(&msg);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "64-byte message, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+
+	QueueWithTag<unique_ptr<int> > q_lock_free_tag;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_lock_free_tag.emplace(new int(i));
+	}
+	# pragma omp parallel 
+	{
+		unique_ptr<int> data;
+		while (q_lock_free_tag.dequeue(&data)) {
+			correct_thread[omp_get_thread_num()].push_back(*data);
+		}
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			if (seen[correct_thread[i][j]]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != N) {
+		cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Generic Correct" << endl;
+}
+
+long resident_kb () {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// rounds of N enqueue/dequeue pairs on one queue: every node used to
+// be a fresh malloc, now only the first round should carve chunks and memory
+// should stay where it was
+void test_recycle () {
+	QueueWithTag<int> q_lock_free_tag;
+	long before = 0;
+	for (int round = 1;round <= RECYCLE_ROUNDS;round++) {
+		double tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int data;
+			q_lock_free_tag.enqueue(i);
+			q_lock_free_tag.dequeue(&data);
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		long chunks = NodeSlab<int>::chunks();
+		cout << "round " << round << ", nodes: " << N << " , new chunks: " << chunks - before << " , rss: " << resident_kb() << " KB , time: " << ttaken << endl;
+		before = chunks;
+	}
+}
+
+// cost of one node allocation plus its free, new/delete against the
+// slab. Every thread allocates a block of nodes and frees every
+// thread_number-th one, so most frees cross threads the way dequeues do
+void test_alloc () {
+	Node<int> **nodes = new Node<int> *[N];
+	for (int slab = 0;slab <= 1;slab++) {
+		double tstart = omp_get_wtime();
+		for (int round = 0;round < ALLOC_ROUNDS;round++) {
+			# pragma omp parallel for schedule(static)
+			for (int i = 0;i < N;i++) {
+				nodes[i] = slab ? NodeSlab<int>::alloc(i) : new Node<int>(i);
+			}
+			# pragma omp parallel for schedule(static, 1)
+			for (int i = 0;i < N;i++) {
+				if (slab) {
+					NodeSlab<int>::recycle(nodes[i]);
+				} else {
+					delete nodes[i];
+				}
+			}
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		cout << (slab ? "slab" : "new/delete") << " alloc+free: " << ttaken*1e9/((double)N*ALLOC_ROUNDS) << " ns per node" << endl;
+	}
+	cout << "slab chunks: " << NodeSlab<int>::chunks() << " of " << SLAB_NODES << " nodes" << endl;
+	delete [] nodes;
+}
+
+// enqueue N payloads, dequeue half of them and drop the queue with the rest
+// still linked; every payload built on the way must be gone afterwards
+void test_destroy () {
+	{
+		QueueWithTag<Counted> q_lock_free_tag;
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			q_lock_free_tag.emplace(i);
+		}
+		# pragma omp parallel for 
+		for (int i = 1;i <= N/2;i++) {
+			Counted data;
+			q_lock_free_tag.dequeue(&data);
+		}
+	}
+	if (Counted::live != 0) {
+		cout << "Live payloads: " << Counted::live << endl;
+		return ;
+	}
+	cout << "Destroy Correct" << endl;
+}
+
 int main(int argc, char *argv[]) {
-	if (argc < 3 || argc > 3) {
+	if (argc < 3 || argc > 4) {
 		printf("error argument number\n");
 		return 0;
 	}
@@ -302,6 +1027,7 @@ int main(int argc, char *argv[]) {
 	thread_number = atoi(argv[1]);
 	correct_thread = new vector<int>[thread_number];
 	int test_method = atoi(argv[2]);
+	backoff_method = (argc > 3) ? atoi(argv[3]) : BACKOFF_EXP;
 
 	omp_set_num_threads(thread_number);
 
@@ -315,6 +1041,27 @@ int main(int argc, char *argv[]) {
 		case 3:
 			test_dequeue_correct();
 			break;
+		case 4:
+			test_backoff();
+			break;
+		case 5:
+			test_bulk();
+			break;
+		case 6:
+			test_blocking();
+			break;
+		case 7:
+			test_generic();
+			break;
+		case 8:
+			test_recycle();
+			break;
+		case 9:
+			test_alloc();
+			break;
+		case 10:
+			test_destroy();
+			break;
 		default:
 			printf("error test method\n");
 			return 0;
@@ -334,7 +1081,7 @@ int main(int argc, char *argv[]) {
 	double tstart = 0.0, ttaken = 0.0;
 	double avg = 0.0;
 	for (int i = 0;i < AVG_TIMES;i++) {
-		QueueWithTag q_lock_free_tag;
+		QueueWithTag<int> q_lock_free_tag;
 		tstart = 0.0;
 		ttaken = 0.0;
 		tstart = omp_get_wtime();
@@ -353,13 +1100,14 @@ int main(int argc, char *argv[]) {
 	cout << "Dequeue: " << endl; 
 	avg = 0.0;
 	for (int i = 0;i < AVG_TIMES;i++) {
-		QueueWithTag q_lock_free_tag;
+		QueueWithTag<int> q_lock_free_tag;
 		tstart = 0.0;
 		ttaken = 0.0;
 		tstart = omp_get_wtime();
 		# pragma omp parallel for 
 		for (int j = 1;j <= N;j++) {
-			q_lock_free_tag.dequeue();
+			int val;
+			q_lock_free_tag.dequeue(&val);
 		}
 		ttaken = omp_get_wtime() - tstart;
 		avg += ttaken;
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
 #include <stdint.h>
 #include <stdbool.h>
 #include <omp.h>
@@ -7,35 +8,49 @@
 #include <time.h>
 #include <map>
 #include <vector>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
 #define N 1000000
-#define MIN_DELAY 1
-#define MAX_DELAY 24
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+#define ELIM_SIZE 16
+#define ELIM_SPINS 256
+#define ELIM_TAKEN ((Node<T> *)1)
+#define CHAIN_LEN 16
 #define AVG_TIMES 20
+#define RECYCLE_ROUNDS 10
+#define CACHE_LINE 64
+#define SLAB_NODES 1024
+#define SLAB_BATCH 64
+#define ALLOC_ROUNDS 10
 
 int thread_number;
+int backoff_method;
 map<int, int> correct_check;
 vector<int> *correct_thread;
 
 /////////////////////////////////////////////////////
 /* structure definition */
 
-struct Node;
-struct Pointer;
-typedef struct Node Node;
-typedef struct Pointer Pointer;
+template <typename T> struct Node;
 
+template <typename T>
 struct Pointer {
-	Node *data;
+	Node<T> *data;
 	unsigned long tag;
 	Pointer () {
 		data = NULL;
 		tag = 0;
 	}
 
-	Pointer(Node *node, unsigned int version_number) {  
+	Pointer(Node<T> *node, unsigned int version_number) {  
 		data = node; 
 		tag = version_number;  
 	}  
@@ -51,18 +66,75 @@ struct Pointer {
 }__attribute__((aligned(16)));
 
 
+template <typename T>
 struct Node {
-	int value;
-	Pointer next;
-	Node () {
-		value = 0;
+	T value;
+	Pointer<T> next;
+	Node () : value() {
+	}
+
+	// the value is built in place from whatever push was given
+	template <typename... Args>
+	Node (Args&&... args) : value(std::forward<Args>(args)...) {
+	}
+};
+
+// a cache-line sized payload for test_generic
+typedef struct Message {
+	int id;
+	char payload[60];
+} Message;
+
+// a payload that counts how many of it are alive, for test_destroy
+struct Counted {
+	static volatile int live;
+	int id;
+
+	Counted () {
+		id = 0;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted (int i) {
+		id = i;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted (const Counted &other) {
+		id = other.id;
+		__sync_fetch_and_add(&live, 1);
+	}
+
+	Counted & operator= (const Counted &other) {
+		id = other.id;
+		return *this;
+	}
+
+	~Counted () {
+		__sync_fetch_and_sub(&live, 1);
 	}
 };
 
+volatile int Counted::live = 0;
+
 
 /////////////////////////////////////////////////////
 /* global inline function */
 
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+// the shared Pointers are plain fields: without this the compiler may load
+// one again instead of using the copy, or load through it ahead of the copy
+inline static void compiler_barrier () {
+	__asm__ __volatile__("" ::: "memory");
+}
+
 inline static bool CAS_ASM_64(volatile uint64_t target[2], uint64_t compare[2], uint64_t set[2]) {
 	bool z;
 	__asm__ __volatile__("movq 0(%4), %%rax;"
@@ -102,60 +174,444 @@ inline static bool CAS2(void *t, void *c, void *s) {
 /////////////////////////////////////////////////////
 /* global function */
 
-void backoff () {
-	static int limit = MIN_DELAY;
-	int delay = rand()%limit*100;
-	limit = min(MAX_DELAY, 2*limit);
-	usleep(delay);
+// bytes per slab slot: small nodes get a power of two share of a cache
+// line and bigger ones whole lines, so no node straddles two of them
+constexpr size_t slab_slot (size_t size, size_t slot = sizeof(void *)) {
+	return slot >= size ? slot : (slot >= CACHE_LINE ? (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE : slab_slot(size, slot*2));
 }
 
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// a small id per thread for the elimination state, handed out on first
+// use: the stack takes no thread id and std::threads all see
+// omp_get_thread_num() == 0
+static volatile int thread_slots = 0;
+static thread_local int thread_slot = __sync_fetch_and_add(&thread_slots, 1);
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
 /////////////////////////////////////////////////////
 /* class definition */
 
+// elimination array (Hendler, Shavit and Yerushalmi): a push that lost
+// the race on top parks its node in a random slot for a while, and a
+// pop that lost the race takes a parked node instead of retrying top.
+// Each thread searches range slots; a partner that never came shrinks
+// the range, a slot that was already busy widens it.
+template <typename T>
+class EliminationArray {
+	private:
+		typedef struct ElimSlot {
+			Node<T> * volatile item;
+			ElimSlot () {
+				item = NULL;
+			}
+		}__attribute__((aligned(64))) ElimSlot;
+
+		typedef struct ElimState {
+			int range;
+			unsigned int seed;
+			long hits;
+			ElimState () {
+				range = 1;
+				seed = 0;
+				hits = 0;
+			}
+		}__attribute__((aligned(64))) ElimState;
+
+		ElimSlot slots[ELIM_SIZE];
+		ElimState *states;
+
+		ElimSlot * pick_slot (ElimState *state) {
+			if (state->seed == 0) {
+				state->seed = (unsigned int)(unsigned long)state | 1;
+			}
+			state->seed ^= state->seed << 13;
+			state->seed ^= state->seed >> 17;
+			state->seed ^= state->seed << 5;
+			return &slots[state->seed % state->range];
+		}
+
+	public:
+		EliminationArray () {
+			states = new ElimState[thread_number];
+		}
+
+		~EliminationArray () {
+			delete [] states;
+		}
+
+		// true if a pop took the node
+		bool push (Node<T> *node, int thread_id) {
+			ElimState *state = &states[thread_id];
+			ElimSlot *slot = pick_slot(state);
+			if (slot->item != NULL || !__sync_bool_compare_and_swap(&slot->item, (Node<T> *)NULL, node)) {
+				state->range = min(ELIM_SIZE, state->range+1);
+				return false;
+			}
+			for (int i = 0;i < ELIM_SPINS;i++) {
+				if (slot->item != node) {
+					break;
+				}
+				cpu_relax();
+			}
+			if (__sync_bool_compare_and_swap(&slot->item, node, (Node<T> *)NULL)) {
+				state->range = max(1, state->range/2);
+				return false;
+			}
+			// the pop left ELIM_TAKEN behind, we own the slot until we clear it
+			__atomic_store_n(&slot->item, (Node<T> *)NULL, __ATOMIC_RELEASE);
+			state->hits++;
+			return true;
+		}
+
+		// a parked node, or NULL if there was none
+		Node<T> * pop (int thread_id) {
+			ElimState *state = &states[thread_id];
+			ElimSlot *slot = pick_slot(state);
+			Node<T> *node = slot->item;
+			if (node == NULL || node == ELIM_TAKEN) {
+				state->range = max(1, state->range/2);
+				return NULL;
+			}
+			if (!__sync_bool_compare_and_swap(&slot->item, node, ELIM_TAKEN)) {
+				state->range = min(ELIM_SIZE, state->range+1);
+				return NULL;
+			}
+			state->hits++;
+			return node;
+		}
+
+		long hits () {
+			long total = 0;
+			for (int i = 0;i < thread_number;i++) {
+				total += states[i].hits;
+			}
+			return total;
+		}
+};
+
+// per-thread slab allocator for the nodes of one value type, shared by
+// every container of that type. A thread carves nodes out of its own
+// chunk of SLAB_NODES slots and keeps the nodes it frees on its own list,
+// whoever allocated them; once that list holds 2*SLAB_BATCH nodes,
+// SLAB_BATCH of them go to the shared depot in one go, and a thread whose
+// chunk ran out takes a whole batch back before it carves a new one.
+// Chunks live as long as the process and next is built only once, so a
+// stale reader of next always reads some node, and every reuse counts up
+// the tag of next so a stale CAS2 on it fails. Only the value is
+// destroyed on recycle and built again on reuse.
+template <typename T>
+class NodeSlab {
+	private:
+		// plain data, so it needs no constructor and no destructor
+		typedef struct Cache {
+			Node<T> *free_nodes;
+			int count;
+			char *cursor;
+			char *end;
+		} Cache;
+
+		typedef struct Depot {
+			// heads of NULL terminated batches
+			vector<Node<T> *> batches;
+			vector<char *> chunks;
+			volatile int lock;
+			Depot () {
+				lock = 0;
+			}
+		} Depot;
+
+		static thread_local Cache cache;
+
+		static Depot * depot () {
+			static Depot *shared = new Depot();
+			return shared;
+		}
+
+		static void lock (Depot *shared) {
+			while (__sync_lock_test_and_set(&shared->lock, 1)) {
+				cpu_relax();
+			}
+		}
+
+		static void unlock (Depot *shared) {
+			__sync_lock_release(&shared->lock);
+		}
+
+		// only once the chunk is used up, so carving stays lock free
+		static bool take_batch (Cache *local) {
+			if (local->cursor != local->end) {
+				return false;
+			}
+			Depot *shared = depot();
+			lock(shared);
+			if (shared->batches.empty()) {
+				unlock(shared);
+				return false;
+			}
+			local->free_nodes = shared->batches.back();
+			local->count = SLAB_BATCH;
+			shared->batches.pop_back();
+			unlock(shared);
+			return true;
+		}
+
+		static void * carve (Cache *local) {
+			if (local->cursor == local->end) {
+				Depot *shared = depot();
+				local->cursor = (char *)aligned_alloc(CACHE_LINE, SLAB_NODES*slab_slot(sizeof(Node<T>)));
+				local->end = local->cursor + SLAB_NODES*slab_slot(sizeof(Node<T>));
+				lock(shared);
+				shared->chunks.push_back(local->cursor);
+				unlock(shared);
+			}
+			void *node = local->cursor;
+			local->cursor += slab_slot(sizeof(Node<T>));
+			return node;
+		}
+
+		static void spill (Cache *local) {
+			Node<T> *first = local->free_nodes;
+			Node<T> *last = first;
+			for (int i = 1;i < SLAB_BATCH;i++) {
+				last = last->next.data;
+			}
+			local->free_nodes = last->next.data;
+			last->next = Pointer<T>(NULL, last->next.tag+1);
+			local->count -= SLAB_BATCH;
+			Depot *shared = depot();
+			lock(shared);
+			shared->batches.push_back(first);
+			unlock(shared);
+		}
+	public:
+		template <typename... Args>
+		static Node<T> * alloc (Args&&... args) {
+			Cache *local = &cache;
+			if (local->free_nodes == NULL && !take_batch(local)) {
+				return new (carve(local)) Node<T>(std::forward<Args>(args)...);
+			}
+			Node<T> *node = local->free_nodes;
+			local->free_nodes = node->next.data;
+			local->count--;
+			new (&node->value) T(std::forward<Args>(args)...);
+			node->next = Pointer<T>(NULL, node->next.tag+1);
+			return node;
+		}
+
+		static void recycle (Node<T> *node) {
+			Cache *local = &cache;
+			node->value.~T();
+			node->next = Pointer<T>(local->free_nodes, node->next.tag+1);
+			local->free_nodes = node;
+			if (++local->count >= 2*SLAB_BATCH) {
+				spill(local);
+			}
+		}
+
+		static long chunks () {
+			Depot *shared = depot();
+			lock(shared);
+			long count = shared->chunks.size();
+			unlock(shared);
+			return count;
+		}
+};
+
+template <typename T>
+thread_local typename NodeSlab<T>::Cache NodeSlab<T>::cache;
+
+template <typename T>
 class StackWithTag {
 	private:
-		Pointer top;
+		int backoff;
+		Pointer<T> top;
+		Node<T> *bottom;
+		EliminationArray<T> *elimination;
 	public:
 
 		StackWithTag () {
-			Node *vnode = new Node();
-			vnode->next = Pointer(NULL, 0);
-			top = Pointer(vnode, 0);
+			backoff = backoff_method;
+			elimination = NULL;
+			Node<T> *vnode = NodeSlab<T>::alloc();
+			top = Pointer<T>(vnode, 0);
+			bottom = vnode;
+		}
+
+		// recycle() also destroys the values nobody took out
+		~StackWithTag () {
+			delete elimination;
+			Node<T> *cur = top.data;
+			while (cur != NULL) {
+				Node<T> *next = cur->next.data;
+				NodeSlab<T>::recycle(cur);
+				cur = next;
+			}
 		}
 
-		void push (int val) {
-			Pointer old_top;  
-			Node *data = new Node();  
-			data->value = val; 
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
+		void enable_elimination () {
+			elimination = new EliminationArray<T>();
+		}
+
+		long eliminated () {
+			return (elimination == NULL) ? 0 : elimination->hits();
+		}
+
+		template <typename... Args>
+		void emplace (Args&&... args) {
+			Backoff bo(backoff);
+			Pointer<T> old_top;  
+			Node<T> *data = NodeSlab<T>::alloc(std::forward<Args>(args)...);  
 			while(true){  
 				old_top = top;
-				Pointer new_pt(top.data, old_top.data->next.tag+1); 
+				compiler_barrier();
+				Pointer<T> new_pt(old_top.data, old_top.data->next.tag+1); 
 				data->next = new_pt;
-				Pointer new_top(data, old_top.tag+1); 
+				Pointer<T> new_top(data, old_top.tag+1); 
 				if (CAS2(&top, &old_top, &new_top)) {
 					break;
 				}
-				backoff();
+				if (elimination == NULL) {
+					bo.wait();
+				} else if (elimination->push(data, thread_slot%thread_number)) {
+					break;
+				}
 			}  
 		}
 
-		Node * pop () {
-			Pointer old_top, old_next;  
-			Node *data = NULL;
+		void push (T val) {
+			emplace(std::move(val));
+		}
+
+		// the node is ours once the CAS (or the exchange) succeeded, so the
+		// value is moved out only then and the node goes back to the slab;
+		// top is never CASed against its next, so no tag has to move
+		bool pop (T *out) {
+			Backoff bo(backoff);
+			Pointer<T> old_top, old_next;  
+			Node<T> *data = NULL;
 			while (true) {
 				old_top = top;
+				compiler_barrier();
 				old_next = (old_top.data)->next;
+				compiler_barrier();
+				// a recycled node may show a NULL next, so recheck before
+				// calling the stack empty
+				if (old_top != top) {
+					bo.wait();
+					continue;
+				}
 				if (old_next.data == NULL) {
-					return NULL;
+					return false;
 				}
-				if (CAS2(&top, &old_top, &old_next)) {
+				Pointer<T> new_top(old_next.data, old_top.tag+1);
+				if (CAS2(&top, &old_top, &new_top)) {
 					data = old_top.data;
 					break;
 				}
-				backoff();
+				if (elimination == NULL) {
+					bo.wait();
+				} else if ((data = elimination->pop(thread_slot%thread_number)) != NULL) {
+					break;
+				}
 			}
-			return data;
+			*out = std::move(data->value);
+			NodeSlab<T>::recycle(data);
+			return true;
 		}		
+
+		// first..last are already linked through next, one CAS puts them on top.
+		// Chains work on the nodes themselves and leave their values alone.
+		void push_chain (Node<T> *first, Node<T> *last) {
+			Backoff bo(backoff);
+			Pointer<T> old_top;
+			while (true) {
+				old_top = top;
+				compiler_barrier();
+				last->next = Pointer<T>(old_top.data, old_top.data->next.tag+1);
+				Pointer<T> new_top(first, old_top.tag+1);
+				if (CAS2(&top, &old_top, &new_top)) {
+					break;
+				}
+				bo.wait();
+			}
+		}
+
+		// detach every node with one CAS, top first. The chain still ends
+		// at the bottom sentinel, so walking it stops at chain_end() and
+		// draining costs one CAS however deep the stack is.
+		Node<T> * pop_all () {
+			Backoff bo(backoff);
+			Pointer<T> old_top;
+			while (true) {
+				old_top = top;
+				compiler_barrier();
+				if (old_top.data == bottom) {
+					return bottom;
+				}
+				Pointer<T> new_top(bottom, old_top.tag+1);
+				if (CAS2(&top, &old_top, &new_top)) {
+					break;
+				}
+				bo.wait();
+			}
+			return old_top.data;
+		}
+
+		Node<T> * chain_end () {
+			return bottom;
+		}
+
+		// hand a chain from pop_all back once its values are out; other
+		// pops may still read the nodes, so they go to the slab, not delete
+		void recycle_chain (Node<T> *chain) {
+			while (chain != bottom) {
+				Node<T> *next = chain->next.data;
+				NodeSlab<T>::recycle(chain);
+				chain = next;
+			}
+		}
 };
 
 /////////////////////////////////////////////////////
@@ -163,7 +619,7 @@ class StackWithTag {
 
 void test_time () {
 	double tstart = 0.0, ttaken = 0.0;
-	StackWithTag s_lock_free_tag;
+	StackWithTag<int> s_lock_free_tag;
 	tstart = omp_get_wtime();
 
 	# pragma omp parallel for 
@@ -180,14 +636,15 @@ void test_time () {
 	tstart = omp_get_wtime();
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		s_lock_free_tag.pop();
+		int val;
+		s_lock_free_tag.pop(&val);
 	}
 	ttaken = omp_get_wtime() - tstart;
 	cout << "pop time: " << ttaken << endl;
 }
 
 void test_push_correct () {
-	StackWithTag s_lock_free_tag;
+	StackWithTag<int> s_lock_free_tag;
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		s_lock_free_tag.push(i);
@@ -196,18 +653,18 @@ void test_push_correct () {
 
 	int count = 0;
 	for (int i = 1;i <= N;i++) {
-		Node *pop_val = s_lock_free_tag.pop();
-		if (pop_val == NULL) {
+		int pop_val;
+		if (!s_lock_free_tag.pop(&pop_val)) {
 			break;
 		}
 		count++;
-		if (correct_check[pop_val->value] == 0) {
+		if (correct_check[pop_val] == 0) {
 			cout << "Unseen variable" << endl;
 			return ;
 		}
 		
-		correct_check[pop_val->value]--;
-		if (correct_check[pop_val->value] < 0) {
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
 			cout << "Multiple variable" << endl;
 			return ;
 		}
@@ -222,15 +679,16 @@ void test_push_correct () {
 }
 
 void test_pop_correct () {
-	StackWithTag s_lock_free_tag;
+	StackWithTag<int> s_lock_free_tag;
 	for (int i = 1;i <= N;i++) {
 		s_lock_free_tag.push(i);
 	}
 
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		Node *data = s_lock_free_tag.pop();
-		correct_thread[omp_get_thread_num()].push_back(data->value);
+		int data;
+		s_lock_free_tag.pop(&data);
+		correct_thread[omp_get_thread_num()].push_back(data);
 	}
 
 	int count = 0;
@@ -257,8 +715,315 @@ void test_pop_correct () {
 	cout << "Pop Correct" << endl;
 }
 
+// the same workload as test_time once for every backoff strategy
+void test_backoff () {
+	const char *names[] = {"none", "exponential", "proportional"};
+	for (int method = BACKOFF_NONE;method <= BACKOFF_PROP;method++) {
+		double tstart = 0.0, push_time = 0.0, pop_time = 0.0;
+		StackWithTag<int> s_lock_free_tag;
+		s_lock_free_tag.set_backoff(method);
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_tag.push(i);
+		}
+		push_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			s_lock_free_tag.pop(&val);
+		}
+		pop_time = omp_get_wtime() - tstart;
+		cout << names[method] << " backoff, push time: " << push_time << " , pop time: " << pop_time << endl;
+	}
+}
+
+// pushes and pops interleaved on a prefilled stack, with and without
+// the elimination array
+void test_elimination () {
+	for (int elim = 0;elim <= 1;elim++) {
+		double tstart = 0.0, ttaken = 0.0;
+		StackWithTag<int> s_lock_free_tag;
+		if (elim) {
+			s_lock_free_tag.enable_elimination();
+		}
+		for (int i = 1;i <= 1000;i++) {
+			s_lock_free_tag.push(i);
+		}
+		for (int i = 0;i < thread_number;i++) {
+			correct_thread[i].clear();
+		}
+
+		long empty = 0;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for reduction(+:empty)
+		for (int i = 1001;i <= N;i++) {
+			if (i&1) {
+				s_lock_free_tag.push(i);
+			} else {
+				int thread_id = omp_get_thread_num();
+				int data;
+				if (!s_lock_free_tag.pop(&data)) {
+					empty++;
+				} else {
+					correct_thread[thread_id].push_back(data);
+				}
+			}
+		}
+		ttaken = omp_get_wtime() - tstart;
+		cout << (elim ? "elimination" : "no elimination") << " mix time: " << ttaken << " , eliminated: " << s_lock_free_tag.eliminated() << " , empty pops: " << empty << endl;
+
+		// every pushed value must come out exactly once
+		vector<int> seen(N+1, 0);
+		int data;
+		while (s_lock_free_tag.pop(&data)) {
+			seen[data]++;
+		}
+		for (int i = 0;i < thread_number;i++) {
+			for (size_t j = 0;j < correct_thread[i].size();j++) {
+				seen[correct_thread[i][j]]++;
+			}
+		}
+		for (int i = 1;i <= N;i++) {
+			if (seen[i] != ((i <= 1000 || (i&1)) ? 1 : 0)) {
+				cout << "Mix incorrect at " << i << endl;
+				return ;
+			}
+		}
+		cout << "Mix Correct" << endl;
+	}
+}
+
+// draining the stack one pop at a time against a single pop_all, then
+// push_chain batches racing with pop_all
+void test_pop_all () {
+	double tstart = 0.0, pop_time = 0.0, pop_all_time = 0.0;
+	{
+		StackWithTag<int> s_lock_free_tag;
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_tag.push(i);
+		}
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			s_lock_free_tag.pop(&val);
+		}
+		pop_time = omp_get_wtime() - tstart;
+	}
+	{
+		StackWithTag<int> s_lock_free_tag;
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_tag.push(i);
+		}
+		tstart = omp_get_wtime();
+		Node<int> *chain = s_lock_free_tag.pop_all();
+		pop_all_time = omp_get_wtime() - tstart;
+		int count = 0;
+		for (Node<int> *cur = chain;cur != s_lock_free_tag.chain_end();cur = cur->next.data) {
+			count++;
+		}
+		s_lock_free_tag.recycle_chain(chain);
+		if (count != N) {
+			cout << "pop_all number: " << count << " , sample number: " << N << endl;
+			return ;
+		}
+	}
+	cout << "pop time: " << pop_time << " , pop_all time: " << pop_all_time << endl;
+
+	StackWithTag<int> s_lock_free_tag;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	tstart = omp_get_wtime();
+	# pragma omp parallel for schedule(static, 1)
+	for (int i = 1;i <= N;i += CHAIN_LEN) {
+		int thread_id = omp_get_thread_num();
+		Node<int> *first = NULL, *last = NULL;
+		for (int j = 0;j < CHAIN_LEN && i+j <= N;j++) {
+			Node<int> *node = NodeSlab<int>::alloc(i+j);
+			if (last == NULL) {
+				first = last = node;
+			} else {
+				last->next.data = node;
+				last = node;
+			}
+		}
+		s_lock_free_tag.push_chain(first, last);
+		if ((i/CHAIN_LEN) % 8 == 0) {
+			Node<int> *chain = s_lock_free_tag.pop_all();
+			for (Node<int> *cur = chain;cur != s_lock_free_tag.chain_end();cur = cur->next.data) {
+				correct_thread[thread_id].push_back(cur->value);
+			}
+			s_lock_free_tag.recycle_chain(chain);
+		}
+	}
+	cout << "push_chain/pop_all time: " << omp_get_wtime() - tstart << endl;
+
+	vector<int> seen(N+1, 0);
+	Node<int> *chain = s_lock_free_tag.pop_all();
+	for (Node<int> *cur = chain;cur != s_lock_free_tag.chain_end();cur = cur->next.data) {
+		seen[cur->value]++;
+	}
+	s_lock_free_tag.recycle_chain(chain);
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			seen[correct_thread[i][j]]++;
+		}
+	}
+	for (int i = 1;i <= N;i++) {
+		if (seen[i] != 1) {
+			cout << "Chain incorrect at " << i << endl;
+			return ;
+		}
+	}
+	cout << "Chain Correct" << endl;
+}
+
+// the same code over a cache-line sized message and over a move-only
+// unique_ptr, which has to be moved in and out of the nodes
+void test_generic () {
+	double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+	{
+		StackWithTag<Message> s_lock_free_tag;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg{};
+			msg.id = i;
+			s_lock_free_tag.push(msg);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg;
+			s_lock_free_tag.pop(&msg);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "64-byte message, push time: " << enqueue_time << " , pop time: " << dequeue_time << endl;
+	}
+
+	StackWithTag<unique_ptr<int> > s_lock_free_tag;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		s_lock_free_tag.emplace(new int(i));
+	}
+	# pragma omp parallel 
+	{
+		unique_ptr<int> data;
+		while (s_lock_free_tag.pop(&data)) {
+			correct_thread[omp_get_thread_num()].push_back(*data);
+		}
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			if (seen[correct_thread[i][j]]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != N) {
+		cout << "Pop number: " << total << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Generic Correct" << endl;
+}
+
+long resident_kb () {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// rounds of N push/pop pairs on one stack: every node used to
+// be a fresh malloc, now only the first round should carve chunks and memory
+// should stay where it was
+void test_recycle () {
+	StackWithTag<int> s_lock_free_tag;
+	long before = 0;
+	for (int round = 1;round <= RECYCLE_ROUNDS;round++) {
+		double tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int data;
+			s_lock_free_tag.push(i);
+			s_lock_free_tag.pop(&data);
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		long chunks = NodeSlab<int>::chunks();
+		cout << "round " << round << ", nodes: " << N << " , new chunks: " << chunks - before << " , rss: " << resident_kb() << " KB , time: " << ttaken << endl;
+		before = chunks;
+	}
+}
+
+// cost of one node allocation plus its free, new/delete against the
+// slab. Every thread allocates a block of nodes and frees every
+// thread_number-th one, so most frees cross threads the way dequeues do
+void test_alloc () {
+	Node<int> **nodes = new Node<int> *[N];
+	for (int slab = 0;slab <= 1;slab++) {
+		double tstart = omp_get_wtime();
+		for (int round = 0;round < ALLOC_ROUNDS;round++) {
+			# pragma omp parallel for schedule(static)
+			for (int i = 0;i < N;i++) {
+				nodes[i] = slab ? NodeSlab<int>::alloc(i) : new Node<int>(i);
+			}
+			# pragma omp parallel for schedule(static, 1)
+			for (int i = 0;i < N;i++) {
+				if (slab) {
+					NodeSlab<int>::recycle(nodes[i]);
+				} else {
+					delete nodes[i];
+				}
+			}
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		cout << (slab ? "slab" : "new/delete") << " alloc+free: " << ttaken*1e9/((double)N*ALLOC_ROUNDS) << " ns per node" << endl;
+	}
+	cout << "slab chunks: " << NodeSlab<int>::chunks() << " of " << SLAB_NODES << " nodes" << endl;
+	delete [] nodes;
+}
+
+// push N payloads, pop half of them and drop the stack with the rest
+// still linked; every payload built on the way must be gone afterwards
+void test_destroy () {
+	{
+		StackWithTag<Counted> s_lock_free_tag;
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_tag.emplace(i);
+		}
+		# pragma omp parallel for 
+		for (int i = 1;i <= N/2;i++) {
+			Counted data;
+			s_lock_free_tag.pop(&data);
+		}
+	}
+	if (Counted::live != 0) {
+		cout << "Live payloads: " << Counted::live << endl;
+		return ;
+	}
+	cout << "Destroy Correct" << endl;
+}
+
 int main(int argc, char *argv[]) {
-	if (argc < 3 || argc > 3) {
+	if (argc < 3 || argc > 4) {
 		printf("error argument number\n");
 		return 0;
 	}
@@ -270,6 +1035,7 @@ int main(int argc, char *argv[]) {
 	thread_number = atoi(argv[1]);
 	correct_thread = new vector<int>[thread_number];
 	int test_method = atoi(argv[2]);
+	backoff_method = (argc > 3) ? atoi(argv[3]) : BACKOFF_EXP;
 
 	omp_set_num_threads(thread_number);
 
@@ -283,6 +1049,27 @@ int main(int argc, char *argv[]) {
 		case 3:
 			test_pop_correct();
 			break;
+		case 4:
+			test_backoff();
+			break;
+		case 5:
+			test_elimination();
+			break;
+		case 6:
+			test_pop_all();
+			break;
+		case 7:
+			test_generic();
+			break;
+		case 8:
+			test_recycle();
+			break;
+		case 9:
+			test_alloc();
+			break;
+		case 10:
+			test_destroy();
+			break;
 		default:
 			printf("error test method\n");
 			return 0;
@@ -1,42 +1,178 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <omp.h>
 #include <unistd.h>
 #include <time.h>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
 #define K 4
 #define R 8
+#define EBR_LIMBO 3
+#define EBR_ADVANCE 64
+#define IBR_ERA_FREQ 64
 #define N 1000000
-#define MIN_DELAY 1
-#define MAX_DELAY 16
+#define FLAT_OPS 100000000L
+#define FLAT_ROUNDS 10
+#define STALL_SAMPLE 1000
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+#define PARK_SPINS 128
+#define WAKE_ROUNDS 1000
+#define WAKE_GAP 200
+#define WAKE_TIMEOUT 1e-3
+#define WF_FAST_TRIES 8
+#define WF_HELP_DELAY 16
+#define WF_FAST -2
+#define WF_PENDING 1UL
+#define WF_ENQUEUE 2UL
+#define LATENCY_PREFILL 1000
+#define CACHE_LINE 64
+#define SLAB_NODES 1024
+#define SLAB_BATCH 64
+#define ALLOC_ROUNDS 10
 class List;
+template <class NodeType>
+class NodeSlab;
 int check = 0;
 
 /////////////////////////////////////////////////////
 /* structure definition */
 
-typedef struct Node {
-	int value;
+template <typename T>
+struct Node {
+	T value;
 	Node *next;
+	unsigned long birth_era;
 
-	Node () {
-		value = 0;
+	Node () : value() {
 		next = NULL;
+		birth_era = 0;
 	}
 	
-	Node (int val) {
-		value = val;
+	// the value is built in place from whatever enqueue was given
+	template <typename... Args>
+	Node (Args&&... args) : value(std::forward<Args>(args)...) {
 		next = NULL;
+		birth_era = 0;
 	}
 	
-} Node;
+};
+
+// a cache-line sized payload for test_generic
+typedef struct Message {
+	int id;
+	char payload[60];
+} Message;
+
+// node of QueueWaitFree. enq_tid names the thread whose slow-path enqueue
+// owns it (-1 on the fast path) and deq_tid the dequeuer that claimed it
+// as the head. A node has two owners, the dequeuer that moves its value
+// out and the one that unlinks it as the dummy; released counts them and
+// the second one retires it.
+template <typename T>
+struct WFNode {
+	T value;
+	WFNode * volatile next;
+	int enq_tid;
+	volatile int deq_tid;
+	volatile int released;
+
+	WFNode () : value() {
+		next = NULL;
+		enq_tid = -1;
+		deq_tid = -1;
+		released = 0;
+	}
+
+	template <typename... Args>
+	WFNode (Args&&... args) : value(std::forward<Args>(args)...) {
+		next = NULL;
+		enq_tid = -1;
+		deq_tid = -1;
+		released = 0;
+	}
+};
+
+// the operation a thread has announced, always replaced as a whole with
+// CAS2; info is phase << 2 | WF_ENQUEUE | WF_PENDING
+template <typename T>
+struct WFState {
+	WFNode<T> * volatile node;
+	volatile unsigned long info;
+
+	WFState () {
+		node = NULL;
+		info = 0;
+	}
+
+	WFState (unsigned long op, WFNode<T> *n) {
+		node = n;
+		info = op;
+	}
+}__attribute__((aligned(64)));
 
+// per-thread state of the occasional helping on the fast path
+typedef struct WFHelp {
+	int count;
+	int next;
+	unsigned long phase;
+	WFHelp () {
+		count = 0;
+		next = 0;
+		phase = 0;
+	}
+}__attribute__((aligned(64))) WFHelp;
+
+// per-thread state of EBRReclaim: the announced epoch << 1 | active,
+// and the epoch each limbo bucket was last filled in
+typedef struct EBRRecord {
+	volatile unsigned long state;
+	unsigned long limbo_epoch[EBR_LIMBO];
+	int retired;
+	EBRRecord () {
+		state = 0;
+		for (int i = 0;i < EBR_LIMBO;i++) {
+			limbo_epoch[i] = 0;
+		}
+		retired = 0;
+	}
+}__attribute__((aligned(64))) EBRRecord;
+
+// per-thread state of IBRReclaim: the reserved era range, empty while
+// lower > upper, and the allocations and retires since the era last moved
+// and the list was last scanned
+typedef struct IBRRecord {
+	volatile unsigned long lower;
+	volatile unsigned long upper;
+	int allocated;
+	int retired;
+	IBRRecord () {
+		lower = ~0UL;
+		upper = 0;
+		allocated = 0;
+		retired = 0;
+	}
+}__attribute__((aligned(64))) IBRRecord;
+
+// hazard pointers and retired nodes are kept untyped, so containers of
+// any value type share them
 typedef struct HPList {
-	Node *HP[K];
+	void *HP[K];
 	HPList () {
 		for (int i = 0;i < K;i++) {
 			HP[i] = NULL;
@@ -44,18 +180,25 @@ typedef struct HPList {
 	}
 } HPList;
 
+// a retired node and the function that frees it as its own type
 typedef struct ListElement {
-	Node *data;
-	struct ListElement *next;
+	void *data;
+	void (*reclaim)(void *);
+	unsigned long birth;
+	unsigned long retire;
 
 	ListElement () {
 		data = NULL;
-		next = NULL;
+		reclaim = NULL;
+		birth = 0;
+		retire = 0;
 	}
 
-	ListElement (Node *node) {
+	ListElement (void *node, void (*func)(void *), unsigned long born, unsigned long retired) {
 		data = node;
-		next = NULL;
+		reclaim = func;
+		birth = born;
+		retire = retired;
 	}
 
 } ListElement;
@@ -65,214 +208,1153 @@ typedef struct ListElement {
 
 HPList *HeadHPList;
 List *retire_list;
+EBRRecord *ebr_record;
+List *limbo_list;
+volatile unsigned long global_epoch = 0;
+IBRRecord *ibr_record;
+List *era_list;
+volatile unsigned long global_era = 0;
 int thread_number;
+int backoff_method;
 map<int, int> correct_check;
 vector<int> *correct_thread;
 
+/////////////////////////////////////////////////////
+/* global inline function */
+
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+inline static long futex_wait (volatile int *addr, int val, const struct timespec *timeout = NULL) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+inline static long futex_wake (volatile int *addr, int count) {
+	return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+inline static bool CAS_ASM_64(volatile uint64_t target[2], uint64_t compare[2], uint64_t set[2]) {
+	bool z;
+	__asm__ __volatile__("movq 0(%4), %%rax;"
+			     "movq 8(%4), %%rdx;"
+			     "lock;" "cmpxchg16b %0; setz %1"
+				: "+m" (*target),
+				  "=q" (z)
+				: "b"  (set[0]),
+				  "c"  (set[1]),
+				  "q"  (compare)
+				: "memory", "cc", "%rax", "%rdx");
+	return z;
+}
+
+
+inline static bool CAS_ASM_32(volatile uint32_t target[2], uint32_t compare[2], uint32_t set[2]) {
+	bool z;
+   __asm__ __volatile__(
+        "lock; cmpxchg8b %1;"
+        "setz %0;"
+            : "=r"(z), "=m"(*target)
+            : "a"(compare[0]), "d" (compare[1]), "b" (set[0]), "c" (set[1])
+            : "memory");
+	return z;
+}
+
+
+
+inline static bool CAS2(void *t, void *c, void *s) {
+	#ifdef __x86_64
+		return CAS_ASM_64((uint64_t *)t, (uint64_t *)c, (uint64_t *)s);
+	#else
+		return CAS_ASM_32((uint32_t *)t, (uint32_t *)c, (uint32_t *)s);
+	#endif
+}
+
 /////////////////////////////////////////////////////
 /* global function */
 
-void backoff () {
-	static int limit = MIN_DELAY;
-	int delay = rand()%limit*100;
-	limit = min(MAX_DELAY, 2*limit);
-	usleep(delay);
+// bytes per slab slot: small nodes get a power of two share of a cache
+// line and bigger ones whole lines, so no node straddles two of them
+constexpr size_t slab_slot (size_t size, size_t slot = sizeof(void *)) {
+	return slot >= size ? slot : (slot >= CACHE_LINE ? (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE : slab_slot(size, slot*2));
+}
+
+template <typename NodeType>
+void reclaim_node (void *node) {
+	NodeSlab<NodeType>::recycle((NodeType *)node);
 }
 
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
 /////////////////////////////////////////////////////
 /* class definition */
 
+// per-thread slab allocator for one node type, shared by every container
+// of that type. A thread carves nodes out of its own chunk of SLAB_NODES
+// slots and keeps the nodes it frees on its own list, whoever allocated
+// them; once that list holds 2*SLAB_BATCH nodes, SLAB_BATCH of them go to
+// the shared depot in one go, and a thread whose chunk ran out takes a
+// whole batch back before it carves a new one. Chunks live as long as the
+// process, so a thread may still free nodes while it exits.
+template <class NodeType>
+class NodeSlab {
+	private:
+		// plain data, so it needs no constructor and no destructor
+		typedef struct Cache {
+			NodeType *free_nodes;
+			int count;
+			char *cursor;
+			char *end;
+		} Cache;
+
+		typedef struct Depot {
+			// heads of NULL terminated batches
+			vector<NodeType *> batches;
+			vector<char *> chunks;
+			volatile int lock;
+			Depot () {
+				lock = 0;
+			}
+		} Depot;
+
+		static thread_local Cache cache;
+
+		static Depot * depot () {
+			static Depot *shared = new Depot();
+			return shared;
+		}
+
+		static void lock (Depot *shared) {
+			while (__sync_lock_test_and_set(&shared->lock, 1)) {
+				cpu_relax();
+			}
+		}
+
+		static void unlock (Depot *shared) {
+			__sync_lock_release(&shared->lock);
+		}
+
+		// a free node links to the next one through its first word
+		static NodeType *& next_free (NodeType *node) {
+			return *(NodeType **)node;
+		}
+
+		// only once the chunk is used up, so carving stays lock free
+		static bool take_batch (Cache *local) {
+			if (local->cursor != local->end) {
+				return false;
+			}
+			Depot *shared = depot();
+			lock(shared);
+			if (shared->batches.empty()) {
+				unlock(shared);
+				return false;
+			}
+			local->free_nodes = shared->batches.back();
+			local->count = SLAB_BATCH;
+			shared->batches.pop_back();
+			unlock(shared);
+			return true;
+		}
+
+		static void * carve (Cache *local) {
+			if (local->cursor == local->end) {
+				Depot *shared = depot();
+				local->cursor = (char *)aligned_alloc(CACHE_LINE, SLAB_NODES*slab_slot(sizeof(NodeType)));
+				local->end = local->cursor + SLAB_NODES*slab_slot(sizeof(NodeType));
+				lock(shared);
+				shared->chunks.push_back(local->cursor);
+				unlock(shared);
+			}
+			void *node = local->cursor;
+			local->cursor += slab_slot(sizeof(NodeType));
+			return node;
+		}
+
+		static void spill (Cache *local) {
+			NodeType *first = local->free_nodes;
+			NodeType *last = first;
+			for (int i = 1;i < SLAB_BATCH;i++) {
+				last = next_free(last);
+			}
+			local->free_nodes = next_free(last);
+			next_free(last) = NULL;
+			local->count -= SLAB_BATCH;
+			Depot *shared = depot();
+			lock(shared);
+			shared->batches.push_back(first);
+			unlock(shared);
+		}
+	public:
+		template <typename... Args>
+		static NodeType * alloc (Args&&... args) {
+			Cache *local = &cache;
+			if (local->free_nodes == NULL && !take_batch(local)) {
+				return new (carve(local)) NodeType(std::forward<Args>(args)...);
+			}
+			NodeType *node = local->free_nodes;
+			local->free_nodes = next_free(node);
+			local->count--;
+			return new (node) NodeType(std::forward<Args>(args)...);
+		}
+
+		static void recycle (NodeType *node) {
+			node->~NodeType();
+			Cache *local = &cache;
+			next_free(node) = local->free_nodes;
+			local->free_nodes = node;
+			if (++local->count >= 2*SLAB_BATCH) {
+				spill(local);
+			}
+		}
+
+		static long chunks () {
+			Depot *shared = depot();
+			lock(shared);
+			long count = shared->chunks.size();
+			unlock(shared);
+			return count;
+		}
+};
+
+template <class NodeType>
+thread_local typename NodeSlab<NodeType>::Cache NodeSlab<NodeType>::cache;
+
+// per-thread retire list. scan copies every published hazard pointer
+// into an array kept between scans, sorts it and frees each retired node
+// that binary search does not find there.
 class List {
 	private:
-		ListElement *head;
-		ListElement *tail;
+		vector<ListElement> retired;
+		vector<void *> hazards;
+		vector<unsigned long> eras;
 	public:
 		int size;
 		List () {
-			head = new ListElement();
-			tail = head;
+			size = 0;
 		}
-		
+
+		// only called once no thread can hold a hazard pointer any more
 		~List () {
-			delete head;
+			clear();
 		}
-		
-		void insert (Node *node) {
-			ListElement *new_element = new ListElement(node);
-			tail->next = new_element;
-			tail = new_element;
+
+		void clear () {
+			for (size_t i = 0;i < retired.size();i++) {
+				retired[i].reclaim(retired[i].data);
+			}
+			retired.clear();
+			size = 0;
+		}
+
+		void insert (void *node, void (*reclaim)(void *), unsigned long birth = 0, unsigned long retire = 0) {
+			retired.push_back(ListElement(node, reclaim, birth, retire));
 			size++;
 		}
 
-		void erase (ListElement *key) {
-			ListElement *cur = head->next;
-			ListElement *pre = head;
-			while (cur != NULL) {
-				if (key->data == cur->data) {
-					pre->next = cur->next;
-					//delete cur->data;
-					size--;
-					break;
+		// with H = threads*K hazard pointers, scanning at 2H retired nodes
+		// frees at least half of them every time
+		int threshold () {
+			return max(R, 2*thread_number*K);
+		}
+
+		void scan () {
+			hazards.clear();
+			for (int i = 0;i < thread_number;i++) {
+				for (int j = 0;j < K;j++) {
+					void *hptr = HeadHPList[i].HP[j];
+					if (hptr != NULL) {
+						hazards.push_back(hptr);
+					}
 				}
-				pre = cur;
-				cur = cur->next;
 			}
-		}
+			sort(hazards.begin(), hazards.end());
 
-		void clearall() {
-			delete head;
-			head = new ListElement();
-			tail = head;
+			int kept = 0;
+			for (size_t i = 0;i < retired.size();i++) {
+				if (binary_search(hazards.begin(), hazards.end(), retired[i].data)) {
+					retired[kept++] = retired[i];
+				} else {
+					retired[i].reclaim(retired[i].data);
+				}
+			}
+			retired.resize(kept);
+			size = kept;
 		}
 
-		ListElement * gethead() {
-			return head->next;
-		}
+		// the IBR counterpart: a node stays while its [birth, retire]
+		// interval meets some thread's reserved [lower, upper]
+		void scan_eras () {
+			eras.clear();
+			for (int i = 0;i < thread_number;i++) {
+				unsigned long lower = ibr_record[i].lower;
+				unsigned long upper = ibr_record[i].upper;
+				if (lower <= upper) {
+					eras.push_back(lower);
+					eras.push_back(upper);
+				}
+			}
 
-		bool find (ListElement **key) {
-			if (*key == NULL) { return false; }
-			if (head == NULL) { return false; }
-			ListElement *cur = head->next;
-			while (cur != NULL) {
-				if (*key == NULL || cur == NULL) { return false; }
-				if ((*key)->data == cur->data) {
-					return true;
+			int kept = 0;
+			for (size_t i = 0;i < retired.size();i++) {
+				bool reserved = false;
+				for (size_t j = 0;j < eras.size();j += 2) {
+					if (retired[i].birth <= eras[j+1] && retired[i].retire >= eras[j]) {
+						reserved = true;
+						break;
+					}
+				}
+				if (reserved) {
+					retired[kept++] = retired[i];
+				} else {
+					retired[i].reclaim(retired[i].data);
 				}
-				cur = cur->next;
 			}
-			return false;
+			retired.resize(kept);
+			size = kept;
 		}
 
 		void show () {
-			ListElement *cur = head->next;
 			cout << "list: "; 
-			while (cur != NULL) {
-				cout << cur->data->value << " ";
-				cur = cur->next;
+			for (size_t i = 0;i < retired.size();i++) {
+				cout << retired[i].data << " ";
 			}
 			cout << endl;
 		}
 };
 
-class QueueHazard {
-	private:
-		Node *head;
-		Node *tail;
+// reclamation policies for the hazard containers. An operation runs
+// between enter and leave; protect publishes a node it is about to read,
+// and validate says whether the shared pointer has to be read again after
+// that. Both keep their state in the per-thread globals.
+class HPReclaim {
 	public:
-		QueueHazard () {
-			head = new Node();
-			tail = head;
+		static const bool validate = true;
+
+		static void enter (int) {
 		}
 
-		~QueueHazard () {
-			delete head;
+		static void leave (int thread_id) {
+			for (int i = 0;i < K;i++) {
+				HeadHPList[thread_id].HP[i] = NULL;
+			}
 		}
 
-		void retire (Node *node, int thread_id) {
-			retire_list[thread_id].insert(node);
-			if (retire_list[thread_id].size >= R) {
-				scan(thread_id);
+		// the store must be visible before the pointer is read again
+		static void protect (int thread_id, int i, void *node) {
+			HeadHPList[thread_id].HP[i] = node;
+			__sync_synchronize();
+		}
+
+		template <class NodeType>
+		static void born (int, NodeType *) {
+		}
+
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			retire_list[thread_id].insert(node, reclaim_node<NodeType>);
+			if (retire_list[thread_id].size >= retire_list[thread_id].threshold()) {
+				retire_list[thread_id].scan();
 			}
 		}
 
-		void scan (int thread_id) {
-			List *private_list = new List();
+		static long pending () {
+			long count = 0;
 			for (int i = 0;i < thread_number;i++) {
-				for (int j = 0;j < K;j++) {
-					Node *hptr = HeadHPList[i].HP[j];
-					if (hptr != NULL) {
-						private_list->insert(hptr);
-					}
+				count += retire_list[i].size;
+			}
+			return count;
+		}
+};
+
+// epoch-based reclamation (Fraser). enter announces the global epoch and
+// leave withdraws it; nothing is published per node. A node retired in
+// epoch e goes to limbo bucket e % EBR_LIMBO and is freed once the epoch
+// reaches e+2, since every thread active then entered after it was
+// unlinked. Every EBR_ADVANCE retires a thread tries to move the epoch
+// on, which only succeeds when no active thread is behind.
+class EBRReclaim {
+	private:
+		static void try_advance () {
+			unsigned long epoch = global_epoch;
+			for (int i = 0;i < thread_number;i++) {
+				unsigned long state = ebr_record[i].state;
+				if ((state & 1) && (state >> 1) != epoch) {
+					return ;
+				}
+			}
+			__sync_bool_compare_and_swap(&global_epoch, epoch, epoch+1);
+		}
+	public:
+		static const bool validate = false;
+
+		// read the epoch again after the announcement is visible, so an
+		// advance in between cannot leave us announcing an old one
+		static void enter (int thread_id) {
+			while (true) {
+				unsigned long epoch = global_epoch;
+				ebr_record[thread_id].state = epoch << 1 | 1;
+				__sync_synchronize();
+				if (global_epoch == epoch) {
+					return ;
 				}
 			}
+		}
+
+		static void leave (int thread_id) {
+			__asm__ __volatile__("" ::: "memory");
+			ebr_record[thread_id].state = 0;
+		}
 
-			ListElement *cur = retire_list[thread_id].gethead();
-			while (cur != NULL) {
-				if (private_list == NULL) {return ;}
-				if (!(private_list->find(&cur))) {
-					retire_list[thread_id].erase(cur);
+		static void protect (int, int, void *) {
+		}
+
+		template <class NodeType>
+		static void born (int, NodeType *) {
+		}
+
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			EBRRecord *rec = &ebr_record[thread_id];
+			unsigned long epoch = global_epoch;
+			for (int i = 0;i < EBR_LIMBO;i++) {
+				if (rec->limbo_epoch[i] + 2 <= epoch) {
+					limbo_list[thread_id*EBR_LIMBO+i].clear();
 				}
-				cur = cur->next;
 			}
+			rec->limbo_epoch[epoch % EBR_LIMBO] = epoch;
+			limbo_list[thread_id*EBR_LIMBO + epoch%EBR_LIMBO].insert(node, reclaim_node<NodeType>);
+			if (++rec->retired >= EBR_ADVANCE) {
+				rec->retired = 0;
+				try_advance();
+			}
+		}
+
+		static long pending () {
+			long count = 0;
+			for (int i = 0;i < thread_number*EBR_LIMBO;i++) {
+				count += limbo_list[i].size;
+			}
+			return count;
+		}
+};
+
+// interval-based reclamation (2GEIBR, Wen et al.). Nodes carry the era
+// they were born in and the era they were retired in; an operation
+// reserves the range of eras [lower, upper] it has read pointers in, and a
+// retired node is freed once its [birth, retire] interval meets nobody's
+// reservation. A stalled thread therefore only keeps the nodes that were
+// alive in its own range. protect widens upper to the current era and
+// needs a fence only when the era has moved since the last pointer.
+class IBRReclaim {
+	public:
+		static const bool validate = true;
+
+		template <class NodeType>
+		static void born (int thread_id, NodeType *node) {
+			node->birth_era = global_era;
+			if (++ibr_record[thread_id].allocated >= IBR_ERA_FREQ) {
+				ibr_record[thread_id].allocated = 0;
+				__sync_fetch_and_add(&global_era, 1);
+			}
+		}
+
+		static void enter (int thread_id) {
+			unsigned long era = global_era;
+			ibr_record[thread_id].lower = era;
+			ibr_record[thread_id].upper = era;
+			__sync_synchronize();
+		}
+
+		static void leave (int thread_id) {
+			__asm__ __volatile__("" ::: "memory");
+			ibr_record[thread_id].upper = 0;
+			ibr_record[thread_id].lower = ~0UL;
+		}
+
+		// the pointer was read before the era, so its birth is covered
+		static void protect (int thread_id, int, void *) {
+			unsigned long era = global_era;
+			if (ibr_record[thread_id].upper != era) {
+				ibr_record[thread_id].upper = era;
+				__sync_synchronize();
+			}
+		}
+
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			era_list[thread_id].insert(node, reclaim_node<NodeType>, node->birth_era, global_era);
+			if (++ibr_record[thread_id].retired >= era_list[thread_id].threshold()) {
+				ibr_record[thread_id].retired = 0;
+				era_list[thread_id].scan_eras();
+			}
+		}
+
+		static long pending () {
+			long count = 0;
+			for (int i = 0;i < thread_number;i++) {
+				count += era_list[i].size;
+			}
+			return count;
+		}
+};
+
+
+template <typename T, class Reclaim = HPReclaim>
+class QueueHazard {
+	private:
+		int backoff;
+		Node<T> *head;
+		Node<T> *tail;
+		volatile int waiters;
+		volatile int wake_seq;
+
+		// the successful enqueue CAS is a full barrier, so reading waiters
+		// after it cannot miss a consumer that registered before its recheck
+		void wake_waiters (int count) {
+			if (waiters > 0) {
+				__sync_fetch_and_add(&wake_seq, 1);
+				futex_wake(&wake_seq, count);
+			}
+		}
+	public:
+		QueueHazard () {
+			backoff = backoff_method;
+			head = NodeSlab<Node<T> >::alloc();
+			tail = head;
+			waiters = 0;
+			wake_seq = 0;
+		}
+
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
+		// retired nodes are left to later scans, only linked ones are freed
+		~QueueHazard () {
+			while (head != NULL) {
+				Node<T> *next = head->next;
+				NodeSlab<Node<T> >::recycle(head);
+				head = next;
+			}
+		}
 
-			delete private_list;
+		void retire (Node<T> *node, int thread_id) {
+			Reclaim::retire(thread_id, node);
 		}
 
-		void enqueue (int val, int thread_id) {
-			Node *new_node = new Node(val);
-			Node *old_tail, *old_next;
+		template <typename... Args>
+		void emplace (int thread_id, Args&&... args) {
+			Reclaim::enter(thread_id);
+			Backoff bo(backoff);
+			Node<T> *new_node = NodeSlab<Node<T> >::alloc(std::forward<Args>(args)...);
+			Reclaim::born(thread_id, new_node);
+			Node<T> *old_tail, *old_next;
 			while (true) {
 				old_tail = tail;
-				HeadHPList[thread_id].HP[0] = old_tail;
-				if (tail != old_tail) {
-					backoff();
+				Reclaim::protect(thread_id, 0, old_tail);
+				if (Reclaim::validate && tail != old_tail) {
+					bo.wait();
 					continue;
 				}
 				old_next = old_tail->next;
-				if (tail != old_tail) {
-					backoff();
+				if (Reclaim::validate && tail != old_tail) {
+					bo.wait();
 					continue;
 				}
 				if (old_next != NULL) {
 					__sync_bool_compare_and_swap(&tail, old_tail, old_next);
-					backoff();
+					bo.wait();
 					continue;
 				}
-				if (__sync_bool_compare_and_swap(&tail->next, NULL, new_node)) {
+				if (__sync_bool_compare_and_swap(&old_tail->next, NULL, new_node)) {
 					break;
 				}
-				backoff();
+				bo.wait();
 			}
 			__sync_bool_compare_and_swap(&tail, old_tail, new_node);
-			HeadHPList[thread_id].HP[0] = NULL;
+			Reclaim::leave(thread_id);
+			wake_waiters(1);
+		}
+
+		void enqueue (T val, int thread_id) {
+			emplace(thread_id, std::move(val));
 		}
 
-		Node * dequeue (int thread_id) {
-			Node *old_tail, *old_head, *old_next; 
-			Node *data = NULL;
+		// the new head stays in the queue as the dummy, but only the thread
+		// whose CAS installed it touches its value; HP[2] keeps it alive
+		// until the value is moved out
+		bool dequeue (T *out, int thread_id) {
+			Reclaim::enter(thread_id);
+			Backoff bo(backoff);
+			Node<T> *old_tail, *old_head, *old_next; 
+			Node<T> *data = NULL;
 			while (true) {
 				old_head = head;
-				HeadHPList[thread_id].HP[1] = old_head;
-				if (head != old_head) {
-					backoff();
+				Reclaim::protect(thread_id, 1, old_head);
+				if (Reclaim::validate && head != old_head) {
+					bo.wait();
 					continue;
 				}
 				old_tail = tail;
 				old_next = old_head->next;
-				HeadHPList[thread_id].HP[2] = old_next;
-				if (head != old_head) {
-					backoff();
+				Reclaim::protect(thread_id, 2, old_next);
+				if (Reclaim::validate && head != old_head) {
+					bo.wait();
 					continue;
 				}
 				if (old_next == NULL) {
-					return NULL;
+					Reclaim::leave(thread_id);
+					return false;
 				}
 				if (old_head == old_tail) {
 					__sync_bool_compare_and_swap(&tail, old_tail, old_next);
-					backoff();
+					bo.wait();
 					continue;
 				}
 				data = old_next;
 				if (__sync_bool_compare_and_swap(&head, old_head, old_next)) {
 					break;
 				}
-				backoff();
+				bo.wait();
 			}
+			*out = std::move(data->value);
 			retire(old_head, thread_id);
-			HeadHPList[thread_id].HP[1] = NULL;
-			HeadHPList[thread_id].HP[2] = NULL;
-			return data;
+			Reclaim::leave(thread_id);
+			return true;
+		}
+
+		// dequeue that waits for an item: spin for a while, then register as
+		// a waiter, recheck and sleep on wake_seq. A negative timeout waits
+		// forever; on timeout the result is false as with dequeue.
+		bool dequeue_for (T *out, double timeout, int thread_id) {
+			double deadline = omp_get_wtime() + timeout;
+			while (true) {
+				for (int i = 0;i < PARK_SPINS;i++) {
+					if (dequeue(out, thread_id)) {
+						return true;
+					}
+					cpu_relax();
+				}
+				int seq = wake_seq;
+				__sync_fetch_and_add(&waiters, 1);
+				bool found = dequeue(out, thread_id);
+				if (!found) {
+					struct timespec ts, *tp = NULL;
+					if (timeout >= 0) {
+						double left = deadline - omp_get_wtime();
+						if (left <= 0) {
+							__sync_fetch_and_sub(&waiters, 1);
+							return false;
+						}
+						ts.tv_sec = (time_t)left;
+						ts.tv_nsec = (long)((left-ts.tv_sec)*1e9);
+						tp = &ts;
+					}
+					futex_wait(&wake_seq, seq, tp);
+				}
+				__sync_fetch_and_sub(&waiters, 1);
+				if (found) {
+					return true;
+				}
+			}
+		}
+
+		void dequeue_wait (T *out, int thread_id) {
+			dequeue_for(out, -1, thread_id);
+		}
+
+		// link the batch privately, then splice it in with one CAS. The
+		// values are moved out of vals.
+		void enqueue_bulk (T *vals, int count, int thread_id) {
+			if (count <= 0) {
+				return ;
+			}
+			Reclaim::enter(thread_id);
+			Backoff bo(backoff);
+			Node<T> *first = NodeSlab<Node<T> >::alloc(std::move(vals[0]));
+			Node<T> *last = first;
+			Reclaim::born(thread_id, first);
+			for (int i = 1;i < count;i++) {
+				last->next = NodeSlab<Node<T> >::alloc(std::move(vals[i]));
+				last = last->next;
+				Reclaim::born(thread_id, last);
+			}
+			Node<T> *old_tail, *old_next;
+			while (true) {
+				old_tail = tail;
+				Reclaim::protect(thread_id, 0, old_tail);
+				if (Reclaim::validate && tail != old_tail) {
+					bo.wait();
+					continue;
+				}
+				old_next = old_tail->next;
+				if (old_next != NULL) {
+					__sync_bool_compare_and_swap(&tail, old_tail, old_next);
+					bo.wait();
+					continue;
+				}
+				if (__sync_bool_compare_and_swap(&old_tail->next, NULL, first)) {
+					break;
+				}
+				bo.wait();
+			}
+			__sync_bool_compare_and_swap(&tail, old_tail, last);
+			Reclaim::leave(thread_id);
+			wake_waiters(count);
+		}
+
+		// up to k values with one CAS on head, returns how many. The walk
+		// goes hand over hand, HP[2] and HP[3] in turn, and rechecks head
+		// after each publish, so every node read is still in the queue.
+		// The values are moved out once the CAS has made the nodes ours.
+		int dequeue_bulk (T *vals, int k, int thread_id) {
+			Reclaim::enter(thread_id);
+			Backoff bo(backoff);
+			Node<T> *old_head, *old_tail, *last;
+			int count;
+			while (true) {
+				old_head = head;
+				Reclaim::protect(thread_id, 1, old_head);
+				if (Reclaim::validate && head != old_head) {
+					bo.wait();
+					continue;
+				}
+				old_tail = tail;
+				last = old_head;
+				count = 0;
+				bool retry = false;
+				while (count < k) {
+					Node<T> *next = last->next;
+					if (next == NULL) {
+						break;
+					}
+					Reclaim::protect(thread_id, 2+count%2, next);
+					if (Reclaim::validate && head != old_head) {
+						retry = true;
+						break;
+					}
+					// never move head past a lagging tail
+					if (last == old_tail) {
+						__sync_bool_compare_and_swap(&tail, old_tail, next);
+						retry = true;
+						break;
+					}
+					count++;
+					last = next;
+				}
+				if (retry) {
+					bo.wait();
+					continue;
+				}
+				if (count == 0 || __sync_bool_compare_and_swap(&head, old_head, last)) {
+					break;
+				}
+				bo.wait();
+			}
+			// everything before the new dummy is ours to retire
+			Node<T> *node = old_head;
+			for (int i = 0;node != last;i++) {
+				Node<T> *next = node->next;
+				vals[i] = std::move(next->value);
+				retire(node, thread_id);
+				node = next;
+			}
+			Reclaim::leave(thread_id);
+			return count;
 		}
 
 };
 
 
+/////////////////////////////////////////////////////
+// Kogan-Petrank queue with the fast-path/slow-path split: an operation
+// first tries the Michael-Scott way WF_FAST_TRIES times, then announces
+// itself in state[] with a phase number and every thread helps all pending
+// operations with a smaller or equal phase before its own. Every
+// WF_HELP_DELAY operations a fast-path thread also looks at one other
+// thread and helps it if it has been pending since the last look, so a
+// slow-path operation finishes in a bounded number of helping steps.
+// Kogan-Petrank assume a garbage collector; here each step first has to
+// publish a hazard pointer and re-read tail or head to validate it, and
+// that retry is unbounded while the pointer keeps moving, so with hazard
+// pointers the queue is only lock-free.
+template <typename T>
+class QueueWaitFree {
+	private:
+		WFNode<T> *head;
+		WFNode<T> *tail;
+		WFState<T> *state;
+		WFHelp *help_record;
+
+		// info is read on both sides of node; a phase never comes back, so
+		// an unchanged info means node belongs to it
+		WFState<T> read_state (int tid) {
+			WFState<T> desc;
+			while (true) {
+				unsigned long info = state[tid].info;
+				desc.node = state[tid].node;
+				desc.info = state[tid].info;
+				if (desc.info == info) {
+					return desc;
+				}
+			}
+		}
+
+		void announce (unsigned long info, WFNode<T> *node, int thread_id) {
+			WFState<T> desc(info, node);
+			while (true) {
+				WFState<T> cur = read_state(thread_id);
+				if (CAS2(&state[thread_id], &cur, &desc)) {
+					return ;
+				}
+			}
+		}
+
+		unsigned long max_phase () {
+			unsigned long phase = 0;
+			for (int i = 0;i < thread_number;i++) {
+				phase = max(phase, state[i].info >> 2);
+			}
+			return phase;
+		}
+
+		bool still_pending (int tid, unsigned long phase) {
+			WFState<T> desc = read_state(tid);
+			return (desc.info & WF_PENDING) && (desc.info >> 2) <= phase;
+		}
+
+		// HP[0] and HP[1] guard the tail and its successor, HP[2] and HP[3]
+		// the head and its successor. Each retry means some other operation
+		// moved the pointer, which is lock-free progress but not a bound.
+		void protect_tail (WFNode<T> **last, WFNode<T> **next, int thread_id) {
+			while (true) {
+				*last = tail;
+				HeadHPList[thread_id].HP[0] = *last;
+				__sync_synchronize();
+				if (tail != *last) {
+					continue;
+				}
+				*next = (*last)->next;
+				HeadHPList[thread_id].HP[1] = *next;
+				__sync_synchronize();
+				if (tail == *last) {
+					return ;
+				}
+			}
+		}
+
+		void protect_head (WFNode<T> **first, WFNode<T> **next, int thread_id) {
+			while (true) {
+				*first = head;
+				HeadHPList[thread_id].HP[2] = *first;
+				__sync_synchronize();
+				if (head != *first) {
+					continue;
+				}
+				*next = (*first)->next;
+				HeadHPList[thread_id].HP[3] = *next;
+				__sync_synchronize();
+				if (head == *first) {
+					return ;
+				}
+			}
+		}
+
+		void clear_hp (int thread_id) {
+			for (int i = 0;i < K;i++) {
+				HeadHPList[thread_id].HP[i] = NULL;
+			}
+		}
+
+		void help (unsigned long phase, int thread_id) {
+			for (int i = 0;i < thread_number;i++) {
+				help_one(i, phase, thread_id);
+			}
+		}
+
+		void help_one (int tid, unsigned long phase, int thread_id) {
+			WFState<T> desc = read_state(tid);
+			if ((desc.info & WF_PENDING) && (desc.info >> 2) <= phase) {
+				if (desc.info & WF_ENQUEUE) {
+					help_enq(tid, phase, thread_id);
+				} else {
+					help_deq(tid, phase, thread_id);
+				}
+			}
+		}
+
+		void help_others (int thread_id) {
+			WFHelp *rec = &help_record[thread_id];
+			if (++rec->count < WF_HELP_DELAY) {
+				return ;
+			}
+			rec->count = 0;
+			WFState<T> desc = read_state(rec->next);
+			if ((desc.info & WF_PENDING) && (desc.info >> 2) == rec->phase) {
+				help_one(rec->next, rec->phase, thread_id);
+			}
+			rec->next = (rec->next + 1) % thread_number;
+			rec->phase = read_state(rec->next).info >> 2;
+		}
+
+		void help_enq (int tid, unsigned long phase, int thread_id) {
+			WFNode<T> *last, *next;
+			while (still_pending(tid, phase)) {
+				protect_tail(&last, &next, thread_id);
+				if (next == NULL) {
+					// the node cannot be linked yet while the op is pending
+					// and last->next is NULL, and a linked last->next never
+					// goes back to NULL
+					WFState<T> desc = read_state(tid);
+					if ((desc.info & WF_PENDING) && (desc.info >> 2) <= phase) {
+						if (__sync_bool_compare_and_swap(&last->next, NULL, desc.node)) {
+							help_finish_enq(thread_id);
+							return ;
+						}
+					}
+				} else {
+					help_finish_enq(thread_id);
+				}
+			}
+		}
+
+		void help_finish_enq (int thread_id) {
+			WFNode<T> *last, *next;
+			protect_tail(&last, &next, thread_id);
+			if (next != NULL) {
+				int tid = next->enq_tid;
+				if (tid >= 0) {
+					WFState<T> cur = read_state(tid);
+					if (last == tail && cur.node == next) {
+						WFState<T> done(cur.info & ~WF_PENDING, next);
+						CAS2(&state[tid], &cur, &done);
+					}
+				}
+				__sync_bool_compare_and_swap(&tail, last, next);
+			}
+		}
+
+		void help_deq (int tid, unsigned long phase, int thread_id) {
+			WFNode<T> *first, *next;
+			while (still_pending(tid, phase)) {
+				protect_head(&first, &next, thread_id);
+				WFNode<T> *last = tail;
+				if (first == last) {
+					if (next == NULL) {
+						WFState<T> cur = read_state(tid);
+						if (last == tail && (cur.info & WF_PENDING) && (cur.info >> 2) <= phase) {
+							WFState<T> empty(cur.info & ~WF_PENDING, NULL);
+							CAS2(&state[tid], &cur, &empty);
+						}
+					} else {
+						help_finish_enq(thread_id);
+					}
+				} else {
+					WFState<T> cur = read_state(tid);
+					if (!((cur.info & WF_PENDING) && (cur.info >> 2) <= phase)) {
+						break;
+					}
+					if (first == head && cur.node != first) {
+						WFState<T> claim(cur.info, first);
+						if (!CAS2(&state[tid], &cur, &claim)) {
+							continue;
+						}
+					}
+					__sync_bool_compare_and_swap(&first->deq_tid, -1, tid);
+					help_finish_deq(thread_id);
+				}
+			}
+		}
+
+		void help_finish_deq (int thread_id) {
+			WFNode<T> *first, *next;
+			protect_head(&first, &next, thread_id);
+			int tid = first->deq_tid;
+			if (tid == -1) {
+				return ;
+			}
+			WFState<T> cur;
+			if (tid >= 0) {
+				cur = read_state(tid);
+			}
+			if (first == head && next != NULL) {
+				if (tid >= 0) {
+					WFState<T> done(cur.info & ~WF_PENDING, cur.node);
+					CAS2(&state[tid], &cur, &done);
+				}
+				__sync_bool_compare_and_swap(&head, first, next);
+			}
+		}
+
+		bool fast_enqueue (WFNode<T> *node, int thread_id) {
+			WFNode<T> *last, *next;
+			for (int i = 0;i < WF_FAST_TRIES;i++) {
+				protect_tail(&last, &next, thread_id);
+				if (next == NULL) {
+					if (__sync_bool_compare_and_swap(&last->next, NULL, node)) {
+						__sync_bool_compare_and_swap(&tail, last, node);
+						return true;
+					}
+				} else {
+					help_finish_enq(thread_id);
+				}
+			}
+			return false;
+		}
+
+		// 1 dequeued, 0 empty, -1 out of tries
+		int fast_dequeue (T *out, int thread_id) {
+			WFNode<T> *first, *next;
+			for (int i = 0;i < WF_FAST_TRIES;i++) {
+				protect_head(&first, &next, thread_id);
+				if (first == tail) {
+					if (next == NULL) {
+						return 0;
+					}
+					help_finish_enq(thread_id);
+				} else if (__sync_bool_compare_and_swap(&first->deq_tid, -1, WF_FAST)) {
+					__sync_bool_compare_and_swap(&head, first, next);
+					*out = std::move(next->value);
+					release(first, thread_id);
+					release(next, thread_id);
+					return 1;
+				} else {
+					help_finish_deq(thread_id);
+				}
+			}
+			return -1;
+		}
+
+		// the second of the two owners of a node retires it
+		void release (WFNode<T> *node, int thread_id) {
+			if (__sync_add_and_fetch(&node->released, 1) == 2) {
+				retire(node, thread_id);
+			}
+		}
+	public:
+		QueueWaitFree () {
+			// the first dummy has no dequeuer to release it
+			head = NodeSlab<WFNode<T> >::alloc();
+			head->released = 1;
+			tail = head;
+			state = new WFState<T>[thread_number];
+			help_record = new WFHelp[thread_number];
+		}
+
+		// retired nodes are left to later scans, only linked ones are freed
+		~QueueWaitFree () {
+			while (head != NULL) {
+				WFNode<T> *next = head->next;
+				NodeSlab<WFNode<T> >::recycle(head);
+				head = next;
+			}
+			delete [] state;
+			delete [] help_record;
+		}
+
+		void retire (WFNode<T> *node, int thread_id) {
+			retire_list[thread_id].insert(node, reclaim_node<WFNode<T> >);
+			if (retire_list[thread_id].size >= retire_list[thread_id].threshold()) {
+				scan(thread_id);
+			}
+		}
+
+		void scan (int thread_id) {
+			retire_list[thread_id].scan();
+		}
+
+		template <typename... Args>
+		void emplace (int thread_id, Args&&... args) {
+			WFNode<T> *node = NodeSlab<WFNode<T> >::alloc(std::forward<Args>(args)...);
+			help_others(thread_id);
+			if (!fast_enqueue(node, thread_id)) {
+				node->enq_tid = thread_id;
+				unsigned long phase = max_phase() + 1;
+				announce(phase << 2 | WF_ENQUEUE | WF_PENDING, node, thread_id);
+				help(phase, thread_id);
+				help_finish_enq(thread_id);
+			}
+			clear_hp(thread_id);
+		}
+
+		void enqueue (T val, int thread_id) {
+			emplace(thread_id, std::move(val));
+		}
+
+		// whoever claimed the head for us, the value is ours to move out of
+		// its successor once the operation is no longer pending
+		bool dequeue (T *out, int thread_id) {
+			help_others(thread_id);
+			int result = fast_dequeue(out, thread_id);
+			if (result < 0) {
+				unsigned long phase = max_phase() + 1;
+				announce(phase << 2 | WF_PENDING, NULL, thread_id);
+				help(phase, thread_id);
+				help_finish_deq(thread_id);
+				WFNode<T> *node = state[thread_id].node;
+				result = 0;
+				if (node != NULL) {
+					WFNode<T> *next = node->next;
+					*out = std::move(next->value);
+					release(node, thread_id);
+					release(next, thread_id);
+					result = 1;
+				}
+			}
+			clear_hp(thread_id);
+			return result == 1;
+		}
+};
+
 /////////////////////////////////////////////////////
 /* main */
 
 void test_time () {
 	double tstart = 0.0, ttaken = 0.0;
-	QueueHazard q_lock_free_hazard;
+	QueueHazard<int> q_lock_free_hazard;
 	tstart = omp_get_wtime();
 
 	# pragma omp parallel for 
@@ -289,14 +1371,15 @@ void test_time () {
 	tstart = omp_get_wtime();
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		q_lock_free_hazard.dequeue(omp_get_thread_num());
+		int val;
+		q_lock_free_hazard.dequeue(&val, omp_get_thread_num());
 	}
 	ttaken = omp_get_wtime() - tstart;
 	cout << "dequeue time: " << ttaken << endl;
 }
 
 void test_enqueue_correct () {
-	QueueHazard q_lock_free_hazard;
+	QueueHazard<int> q_lock_free_hazard;
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		q_lock_free_hazard.enqueue(i, omp_get_thread_num());
@@ -306,19 +1389,19 @@ void test_enqueue_correct () {
 	int count = 0;
 	
 	for (int i = 1;i <= N;i++) {
-		Node *pop_val = q_lock_free_hazard.dequeue(omp_get_thread_num());
-		if (pop_val == NULL) {
+		int pop_val;
+		if (!q_lock_free_hazard.dequeue(&pop_val, omp_get_thread_num())) {
 			break;
 		}
 		count++;
 		
-		if (correct_check[pop_val->value] == 0) {
+		if (correct_check[pop_val] == 0) {
 			cout << "Unseen variable" << endl;
 			return ;
 		}
 		
-		correct_check[pop_val->value]--;
-		if (correct_check[pop_val->value] < 0) {
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
 			cout << "Multiple variable" << endl;
 			return ;
 		}
@@ -333,7 +1416,7 @@ void test_enqueue_correct () {
 }
 
 void test_dequeue_correct () {
-	QueueHazard q_lock_free_hazard;
+	QueueHazard<int> q_lock_free_hazard;
 	for (int i = 1;i <= N;i++) {
 		q_lock_free_hazard.enqueue(i, omp_get_thread_num());
 	}
@@ -344,8 +1427,9 @@ void test_dequeue_correct () {
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		int thread_id = omp_get_thread_num();
-		Node *data = q_lock_free_hazard.dequeue(thread_id);
-		correct_thread[thread_id].push_back(data->value);
+		int data;
+		q_lock_free_hazard.dequeue(&data, thread_id);
+		correct_thread[thread_id].push_back(data);
 	}
 	
 	int count = 0;
@@ -374,9 +1458,390 @@ void test_dequeue_correct () {
 }
 
 
+// the same workload as test_time once for every backoff strategy
+void test_backoff () {
+	const char *names[] = {"none", "exponential", "proportional"};
+	for (int method = BACKOFF_NONE;method <= BACKOFF_PROP;method++) {
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		QueueHazard<int> q_lock_free_hazard;
+		q_lock_free_hazard.set_backoff(method);
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			q_lock_free_hazard.enqueue(i, omp_get_thread_num());
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			q_lock_free_hazard.dequeue(&val, omp_get_thread_num());
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << names[method] << " backoff, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+}
+
+// enqueue_bulk/dequeue_bulk over a range of batch sizes
+void test_bulk () {
+	int batch_sizes[] = {1, 4, 16, 64, 256};
+	for (int b = 0;b < 5;b++) {
+		int batch = batch_sizes[b];
+		int batches = (N+batch-1)/batch;
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		QueueHazard<int> q_lock_free_hazard;
+		for (int i = 0;i < thread_number;i++) {
+			correct_thread[i].clear();
+		}
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int j = 0;j < batches;j++) {
+			int vals[256];
+			int count = min(batch, N-j*batch);
+			for (int i = 0;i < count;i++) {
+				vals[i] = j*batch+i+1;
+			}
+			q_lock_free_hazard.enqueue_bulk(vals, count, omp_get_thread_num());
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel 
+		{
+			int vals[256];
+			int count;
+			while ((count = q_lock_free_hazard.dequeue_bulk(vals, batch, omp_get_thread_num())) > 0) {
+				for (int i = 0;i < count;i++) {
+					correct_thread[omp_get_thread_num()].push_back(vals[i]);
+				}
+			}
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "batch " << batch << " , enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+
+		vector<int> seen(N+1, 0);
+		int total = 0;
+		for (int i = 0;i < thread_number;i++) {
+			for (size_t j = 0;j < correct_thread[i].size();j++) {
+				total++;
+				if (seen[correct_thread[i][j]]++ != 0) {
+					cout << "Multiple variable" << endl;
+					return ;
+				}
+			}
+		}
+		if (total != N) {
+			cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+			return ;
+		}
+	}
+	cout << "Bulk Correct" << endl;
+}
+
+// one producer, the other threads consume either by polling dequeue or
+// by parking in dequeue_for; reports wake-up latency and CPU time per
+// wall-clock second
+void test_blocking () {
+	if (thread_number < 2) {
+		cout << "blocking test needs at least 2 threads" << endl;
+		return ;
+	}
+	const char *names[] = {"busy poll", "futex park"};
+	for (int park = 0;park <= 1;park++) {
+		QueueHazard<int> q_lock_free_hazard;
+		vector<double> sent(WAKE_ROUNDS), got(WAKE_ROUNDS);
+		volatile int received = 0;
+		struct rusage start_usage, end_usage;
+		getrusage(RUSAGE_SELF, &start_usage);
+		double tstart = omp_get_wtime();
+		# pragma omp parallel
+		{
+			if (omp_get_thread_num() == 0) {
+				for (int i = 0;i < WAKE_ROUNDS;i++) {
+					usleep(WAKE_GAP);
+					sent[i] = omp_get_wtime();
+					q_lock_free_hazard.enqueue(i, omp_get_thread_num());
+				}
+			} else {
+				while (received < WAKE_ROUNDS) {
+					int data;
+					if (!(park ? q_lock_free_hazard.dequeue_for(&data, WAKE_TIMEOUT, omp_get_thread_num()) : q_lock_free_hazard.dequeue(&data, omp_get_thread_num()))) {
+						cpu_relax();
+						continue;
+					}
+					got[data] = omp_get_wtime();
+					__sync_fetch_and_add(&received, 1);
+				}
+			}
+		}
+		double wall = omp_get_wtime() - tstart;
+		getrusage(RUSAGE_SELF, &end_usage);
+		double cpu = (end_usage.ru_utime.tv_sec-start_usage.ru_utime.tv_sec) + (end_usage.ru_utime.tv_usec-start_usage.ru_utime.tv_usec)*1e-6
+			+ (end_usage.ru_stime.tv_sec-start_usage.ru_stime.tv_sec) + (end_usage.ru_stime.tv_usec-start_usage.ru_stime.tv_usec)*1e-6;
+		double latency = 0.0;
+		for (int i = 0;i < WAKE_ROUNDS;i++) {
+			latency += got[i] - sent[i];
+		}
+		cout << names[park] << ", avg wake-up latency: " << latency/WAKE_ROUNDS*1e6 << " us , cpu: " << cpu/wall << " cores" << endl;
+	}
+
+	QueueHazard<int> q_lock_free_hazard;
+	double tstart = omp_get_wtime();
+	int data;
+	bool found = q_lock_free_hazard.dequeue_for(&data, WAKE_TIMEOUT, omp_get_thread_num());
+	cout << "empty dequeue_for(" << WAKE_TIMEOUT << ") returned " << (found ? "an item" : "nothing") << " after " << omp_get_wtime() - tstart << endl;
+}
+
+// the same code over a cache-line sized message and over a move-only
+// unique_ptr, which has to be moved in and out of the nodes
+void test_generic () {
+	double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+	{
+		QueueHazard<Message> q_lock_free_hazard;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg{};
+			msg.id = i;
+			q_lock_free_hazard.enqueue(msg, omp_get_thread_num());
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg;
+			q_lock_free_hazard.dequeue(&msg, omp_get_thread_num());
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "64-byte message, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+
+	QueueHazard<unique_ptr<int> > q_lock_free_hazard;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_lock_free_hazard.emplace(omp_get_thread_num(), new int(i));
+	}
+	# pragma omp parallel 
+	{
+		unique_ptr<int> data;
+		while (q_lock_free_hazard.dequeue(&data, omp_get_thread_num())) {
+			correct_thread[omp_get_thread_num()].push_back(*data);
+		}
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			if (seen[correct_thread[i][j]]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != N) {
+		cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Generic Correct" << endl;
+}
+
+// a mixed enqueue/dequeue run that times every operation on its own and
+// reports the tail of the latency distribution next to the throughput
+template <class Queue>
+void test_latency (const char *name) {
+	Queue q;
+	for (int i = 1;i <= LATENCY_PREFILL;i++) {
+		q.enqueue(i, 0);
+	}
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	vector<double> *latency = new vector<double>[thread_number];
+	double tstart = omp_get_wtime();
+	# pragma omp parallel for 
+	for (int i = LATENCY_PREFILL+1;i <= N;i++) {
+		int thread_id = omp_get_thread_num();
+		double start = omp_get_wtime();
+		if (i % 2) {
+			q.enqueue(i, thread_id);
+			latency[thread_id].push_back(omp_get_wtime() - start);
+		} else {
+			int data;
+			bool found = q.dequeue(&data, thread_id);
+			latency[thread_id].push_back(omp_get_wtime() - start);
+			if (found) {
+				correct_thread[thread_id].push_back(data);
+			}
+		}
+	}
+	double ttaken = omp_get_wtime() - tstart;
+	vector<double> all;
+	for (int i = 0;i < thread_number;i++) {
+		all.insert(all.end(), latency[i].begin(), latency[i].end());
+	}
+	delete [] latency;
+	sort(all.begin(), all.end());
+	cout << name << ", throughput: " << all.size()/ttaken << " ops/s , p99.99: " << all[(size_t)(all.size()*0.9999)]*1e6
+		<< " us , max: " << all.back()*1e6 << " us" << endl;
+
+	// every value enqueued comes out exactly once
+	int data;
+	while (q.dequeue(&data, 0)) {
+		correct_thread[0].push_back(data);
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0, expect = LATENCY_PREFILL;
+	for (int i = LATENCY_PREFILL+1;i <= N;i++) {
+		expect += i % 2;
+	}
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			int val = correct_thread[i][j];
+			if ((val > LATENCY_PREFILL && val % 2 == 0) || seen[val]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != expect) {
+		cout << "Dequeue number: " << total << " , Sample number: " << expect << endl;
+		return ;
+	}
+	cout << name << " Correct" << endl;
+}
+
+void test_wait_free () {
+	test_latency<QueueHazard<int> >("lock-free");
+	test_latency<QueueWaitFree<int> >("wait-free");
+}
+
+long resident_kb () {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 100M operations in FLAT_ROUNDS rounds of enqueue/dequeue pairs on one queue;
+// resident memory and the nodes still waiting in the retire lists should
+// stay flat from round to round
+void test_reclaim () {
+	QueueHazard<int> q_lock_free_hazard;
+	long per_round = FLAT_OPS / FLAT_ROUNDS;
+	for (int round = 1;round <= FLAT_ROUNDS;round++) {
+		double tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (long i = 0;i < per_round/2;i++) {
+			int data;
+			q_lock_free_hazard.enqueue(i, omp_get_thread_num());
+			q_lock_free_hazard.dequeue(&data, omp_get_thread_num());
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		long retired = 0;
+		for (int i = 0;i < thread_number;i++) {
+			retired += retire_list[i].size;
+		}
+		cout << "ops: " << round*per_round << " , rss: " << resident_kb() << " KB , retired: " << retired << " , time: " << ttaken << endl;
+	}
+}
+
+// enqueue/dequeue pairs under each reclamation policy: the time with every
+// thread running, then the peak of retired but unfreed nodes while thread
+// 0 sits inside an operation until the others are done. Under HP a
+// stalled thread can only pin its K hazard pointers, so it is not made to
+// hold any here.
+template <class Reclaim>
+void test_domain (const char *name) {
+	double tstart = omp_get_wtime();
+	{
+		QueueHazard<int, Reclaim> q_lock_free_hazard;
+		# pragma omp parallel for 
+		for (int i = 0;i < N;i++) {
+			int data;
+			q_lock_free_hazard.enqueue(i, omp_get_thread_num());
+			q_lock_free_hazard.dequeue(&data, omp_get_thread_num());
+		}
+	}
+	double ttaken = omp_get_wtime() - tstart;
+
+	QueueHazard<int, Reclaim> q_lock_free_hazard;
+	volatile int running = thread_number - 1;
+	long base = Reclaim::pending(), peak = 0;
+	# pragma omp parallel
+	{
+		int thread_id = omp_get_thread_num();
+		if (thread_id == 0) {
+			Reclaim::enter(thread_id);
+			while (running > 0) {
+				peak = max(peak, Reclaim::pending() - base);
+				usleep(STALL_SAMPLE);
+			}
+			Reclaim::leave(thread_id);
+		} else {
+			for (int i = 0;i < N/(thread_number-1);i++) {
+				int data;
+				q_lock_free_hazard.enqueue(i, thread_id);
+				q_lock_free_hazard.dequeue(&data, thread_id);
+			}
+			__sync_fetch_and_sub(&running, 1);
+		}
+	}
+	cout << name << ", time: " << ttaken << " , peak unreclaimed with a stalled thread: " << peak << " nodes (" << peak*sizeof(Node<int>)/1024 << " KB)" << endl;
+}
+
+void test_reclaim_domain () {
+	if (thread_number < 2) {
+		cout << "reclamation test needs at least 2 threads" << endl;
+		return ;
+	}
+	test_domain<HPReclaim>("hazard pointers");
+	test_domain<EBRReclaim>("epochs");
+	test_domain<IBRReclaim>("interval eras");
+}
+
+// cost of one node allocation plus its free, new/delete against the
+// slab. Every thread allocates a block of nodes and frees every
+// thread_number-th one, so most frees cross threads the way dequeues do
+void test_alloc () {
+	Node<int> **nodes = new Node<int> *[N];
+	for (int slab = 0;slab <= 1;slab++) {
+		double tstart = omp_get_wtime();
+		for (int round = 0;round < ALLOC_ROUNDS;round++) {
+			# pragma omp parallel for schedule(static)
+			for (int i = 0;i < N;i++) {
+				nodes[i] = slab ? NodeSlab<Node<int> >::alloc(i) : new Node<int>(i);
+			}
+			# pragma omp parallel for schedule(static, 1)
+			for (int i = 0;i < N;i++) {
+				if (slab) {
+					NodeSlab<Node<int> >::recycle(nodes[i]);
+				} else {
+					delete nodes[i];
+				}
+			}
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		cout << (slab ? "slab" : "new/delete") << " alloc+free: " << ttaken*1e9/((double)N*ALLOC_ROUNDS) << " ns per node" << endl;
+	}
+	cout << "slab chunks: " << NodeSlab<Node<int> >::chunks() << " of " << SLAB_NODES << " nodes" << endl;
+	delete [] nodes;
+}
+
 int main (int argc, char *argv[]) {
 
-	if (argc < 3 || argc > 3) {
+	if (argc < 3 || argc > 4) {
 		printf("error argument number\n");
 		return 0;
 	}
@@ -388,9 +1853,14 @@ int main (int argc, char *argv[]) {
 	thread_number = atoi(argv[1]);
 	correct_thread = new vector<int>[thread_number];
 	int test_method = atoi(argv[2]);
+	backoff_method = (argc > 3) ? atoi(argv[3]) : BACKOFF_EXP;
 
 	HeadHPList = new HPList[thread_number];
 	retire_list = new List[thread_number];
+	ebr_record = new EBRRecord[thread_number];
+	limbo_list = new List[thread_number*EBR_LIMBO];
+	ibr_record = new IBRRecord[thread_number];
+	era_list = new List[thread_number];
 
 	omp_set_num_threads(thread_number);
 
@@ -404,6 +1874,30 @@ int main (int argc, char *argv[]) {
 		case 3:
 			test_dequeue_correct();
 			break;
+		case 4:
+			test_backoff();
+			break;
+		case 5:
+			test_bulk();
+			break;
+		case 6:
+			test_blocking();
+			break;
+		case 7:
+			test_generic();
+			break;
+		case 8:
+			test_wait_free();
+			break;
+		case 9:
+			test_reclaim();
+			break;
+		case 10:
+			test_reclaim_domain();
+			break;
+		case 11:
+			test_alloc();
+			break;
 		default:
 			printf("error test method\n");
 			return 0;
@@ -426,7 +1920,7 @@ int main (int argc, char *argv[]) {
 	double tstart = 0.0, ttaken = 0.0;
 	double avg = 0.0;
 	for (int i = 0;i < AVG_TIMES;i++) {
-		QueueHazard q_lock_free_hazard;
+		QueueHazard<int> q_lock_free_hazard;
 		tstart = 0.0;
 		ttaken = 0.0;
 		tstart = omp_get_wtime();
@@ -445,13 +1939,14 @@ int main (int argc, char *argv[]) {
 	cout << "Dequeue: " << endl; 
 	avg = 0.0;
 	for (int i = 0;i < AVG_TIMES;i++) {
-		QueueHazard q_lock_free_hazard;
+		QueueHazard<int> q_lock_free_hazard;
 		tstart = 0.0;
 		ttaken = 0.0;
 		tstart = omp_get_wtime();
 		# pragma omp parallel for 
 		for (int j = 1;j <= N;j++) {
-			q_lock_free_hazard.dequeue(omp_get_thread_num());
+			int val;
+			q_lock_free_hazard.dequeue(&val, omp_get_thread_num());
 		}
 		ttaken = omp_get_wtime() - tstart;
 		avg += ttaken;
@@ -1,41 +1,108 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstdio>
 #include <omp.h>
 #include <unistd.h>
 #include <time.h>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
 #define K 4
 #define R 8
+#define EBR_LIMBO 3
+#define EBR_ADVANCE 64
+#define IBR_ERA_FREQ 64
 #define N 1000000
-#define MIN_DELAY 1
-#define MAX_DELAY 16
+#define FLAT_OPS 100000000L
+#define FLAT_ROUNDS 10
+#define STALL_SAMPLE 1000
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+#define ELIM_SIZE 16
+#define ELIM_SPINS 256
+#define ELIM_TAKEN ((Node<T> *)1)
+#define CHAIN_LEN 16
+#define CACHE_LINE 64
+#define SLAB_NODES 1024
+#define SLAB_BATCH 64
+#define ALLOC_ROUNDS 10
 class List;
+template <class NodeType>
+class NodeSlab;
 
 /////////////////////////////////////////////////////
 /* structure definition */
 
-typedef struct Node {
-	int value;
+template <typename T>
+struct Node {
+	T value;
 	Node *next;
+	unsigned long birth_era;
 
-	Node () {
-		value = 0;
+	Node () : value() {
 		next = NULL;
+		birth_era = 0;
 	}
 	
-	Node (int val) {
-		value = val;
+	// the value is built in place from whatever push was given
+	template <typename... Args>
+	Node (Args&&... args) : value(std::forward<Args>(args)...) {
 		next = NULL;
+		birth_era = 0;
 	}
 	
-} Node;
+};
+
+// a cache-line sized payload for test_generic
+typedef struct Message {
+	int id;
+	char payload[60];
+} Message;
+
+// per-thread state of EBRReclaim: the announced epoch << 1 | active,
+// and the epoch each limbo bucket was last filled in
+typedef struct EBRRecord {
+	volatile unsigned long state;
+	unsigned long limbo_epoch[EBR_LIMBO];
+	int retired;
+	EBRRecord () {
+		state = 0;
+		for (int i = 0;i < EBR_LIMBO;i++) {
+			limbo_epoch[i] = 0;
+		}
+		retired = 0;
+	}
+}__attribute__((aligned(64))) EBRRecord;
 
+// per-thread state of IBRReclaim: the reserved era range, empty while
+// lower > upper, and the allocations and retires since the era last moved
+// and the list was last scanned
+typedef struct IBRRecord {
+	volatile unsigned long lower;
+	volatile unsigned long upper;
+	int allocated;
+	int retired;
+	IBRRecord () {
+		lower = ~0UL;
+		upper = 0;
+		allocated = 0;
+		retired = 0;
+	}
+}__attribute__((aligned(64))) IBRRecord;
+
+// hazard pointers and retired nodes are kept untyped, so containers of
+// any value type share them
 typedef struct HPList {
-	Node *HP[K];
+	void *HP[K];
 	HPList () {
 		for (int i = 0;i < K;i++) {
 			HP[i] = NULL;
@@ -43,18 +110,25 @@ typedef struct HPList {
 	}
 } HPList;
 
+// a retired node and the function that frees it as its own type
 typedef struct ListElement {
-	Node *data;
-	struct ListElement *next;
+	void *data;
+	void (*reclaim)(void *);
+	unsigned long birth;
+	unsigned long retire;
 
 	ListElement () {
 		data = NULL;
-		next = NULL;
+		reclaim = NULL;
+		birth = 0;
+		retire = 0;
 	}
 
-	ListElement (Node *node) {
+	ListElement (void *node, void (*func)(void *), unsigned long born, unsigned long retired) {
 		data = node;
-		next = NULL;
+		reclaim = func;
+		birth = born;
+		retire = retired;
 	}
 
 } ListElement;
@@ -64,191 +138,742 @@ typedef struct ListElement {
 
 HPList *HeadHPList;
 List *retire_list;
+EBRRecord *ebr_record;
+List *limbo_list;
+volatile unsigned long global_epoch = 0;
+IBRRecord *ibr_record;
+List *era_list;
+volatile unsigned long global_era = 0;
 int thread_number;
+int backoff_method;
 map<int, int> correct_check;
 vector<int> *correct_thread;
 
+/////////////////////////////////////////////////////
+/* global inline function */
+
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
 /////////////////////////////////////////////////////
 /* global function */
 
-void backoff () {
-	static int limit = MIN_DELAY;
-	int delay = rand()%limit*100;
-	limit = min(MAX_DELAY, 2*limit);
-	usleep(delay);
+// bytes per slab slot: small nodes get a power of two share of a cache
+// line and bigger ones whole lines, so no node straddles two of them
+constexpr size_t slab_slot (size_t size, size_t slot = sizeof(void *)) {
+	return slot >= size ? slot : (slot >= CACHE_LINE ? (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE : slab_slot(size, slot*2));
 }
 
+template <typename NodeType>
+void reclaim_node (void *node) {
+	NodeSlab<NodeType>::recycle((NodeType *)node);
+}
+
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
 /////////////////////////////////////////////////////
 /* class definition */
 
+// per-thread slab allocator for one node type, shared by every container
+// of that type. A thread carves nodes out of its own chunk of SLAB_NODES
+// slots and keeps the nodes it frees on its own list, whoever allocated
+// them; once that list holds 2*SLAB_BATCH nodes, SLAB_BATCH of them go to
+// the shared depot in one go, and a thread whose chunk ran out takes a
+// whole batch back before it carves a new one. Chunks live as long as the
+// process, so a thread may still free nodes while it exits.
+template <class NodeType>
+class NodeSlab {
+	private:
+		// plain data, so it needs no constructor and no destructor
+		typedef struct Cache {
+			NodeType *free_nodes;
+			int count;
+			char *cursor;
+			char *end;
+		} Cache;
+
+		typedef struct Depot {
+			// heads of NULL terminated batches
+			vector<NodeType *> batches;
+			vector<char *> chunks;
+			volatile int lock;
+			Depot () {
+				lock = 0;
+			}
+		} Depot;
+
+		static thread_local Cache cache;
+
+		static Depot * depot () {
+			static Depot *shared = new Depot();
+			return shared;
+		}
+
+		static void lock (Depot *shared) {
+			while (__sync_lock_test_and_set(&shared->lock, 1)) {
+				cpu_relax();
+			}
+		}
+
+		static void unlock (Depot *shared) {
+			__sync_lock_release(&shared->lock);
+		}
+
+		// a free node links to the next one through its first word
+		static NodeType *& next_free (NodeType *node) {
+			return *(NodeType **)node;
+		}
+
+		// only once the chunk is used up, so carving stays lock free
+		static bool take_batch (Cache *local) {
+			if (local->cursor != local->end) {
+				return false;
+			}
+			Depot *shared = depot();
+			lock(shared);
+			if (shared->batches.empty()) {
+				unlock(shared);
+				return false;
+			}
+			local->free_nodes = shared->batches.back();
+			local->count = SLAB_BATCH;
+			shared->batches.pop_back();
+			unlock(shared);
+			return true;
+		}
+
+		static void * carve (Cache *local) {
+			if (local->cursor == local->end) {
+				Depot *shared = depot();
+				local->cursor = (char *)aligned_alloc(CACHE_LINE, SLAB_NODES*slab_slot(sizeof(NodeType)));
+				local->end = local->cursor + SLAB_NODES*slab_slot(sizeof(NodeType));
+				lock(shared);
+				shared->chunks.push_back(local->cursor);
+				unlock(shared);
+			}
+			void *node = local->cursor;
+			local->cursor += slab_slot(sizeof(NodeType));
+			return node;
+		}
+
+		static void spill (Cache *local) {
+			NodeType *first = local->free_nodes;
+			NodeType *last = first;
+			for (int i = 1;i < SLAB_BATCH;i++) {
+				last = next_free(last);
+			}
+			local->free_nodes = next_free(last);
+			next_free(last) = NULL;
+			local->count -= SLAB_BATCH;
+			Depot *shared = depot();
+			lock(shared);
+			shared->batches.push_back(first);
+			unlock(shared);
+		}
+	public:
+		template <typename... Args>
+		static NodeType * alloc (Args&&... args) {
+			Cache *local = &cache;
+			if (local->free_nodes == NULL && !take_batch(local)) {
+				return new (carve(local)) NodeType(std::forward<Args>(args)...);
+			}
+			NodeType *node = local->free_nodes;
+			local->free_nodes = next_free(node);
+			local->count--;
+			return new (node) NodeType(std::forward<Args>(args)...);
+		}
+
+		static void recycle (NodeType *node) {
+			node->~NodeType();
+			Cache *local = &cache;
+			next_free(node) = local->free_nodes;
+			local->free_nodes = node;
+			if (++local->count >= 2*SLAB_BATCH) {
+				spill(local);
+			}
+		}
+
+		static long chunks () {
+			Depot *shared = depot();
+			lock(shared);
+			long count = shared->chunks.size();
+			unlock(shared);
+			return count;
+		}
+};
+
+template <class NodeType>
+thread_local typename NodeSlab<NodeType>::Cache NodeSlab<NodeType>::cache;
+
+// per-thread retire list. scan copies every published hazard pointer
+// into an array kept between scans, sorts it and frees each retired node
+// that binary search does not find there.
 class List {
 	private:
-		ListElement *head;
-		ListElement *tail;
+		vector<ListElement> retired;
+		vector<void *> hazards;
+		vector<unsigned long> eras;
 	public:
 		int size;
 		List () {
-			head = new ListElement();
-			tail = head;
+			size = 0;
 		}
-		
+
+		// only called once no thread can hold a hazard pointer any more
 		~List () {
-			delete head;
+			clear();
 		}
-		
-		void insert (Node *node) {
-			ListElement *new_element = new ListElement(node);
-			tail->next = new_element;
-			tail = new_element;
+
+		void clear () {
+			for (size_t i = 0;i < retired.size();i++) {
+				retired[i].reclaim(retired[i].data);
+			}
+			retired.clear();
+			size = 0;
+		}
+
+		void insert (void *node, void (*reclaim)(void *), unsigned long birth = 0, unsigned long retire = 0) {
+			retired.push_back(ListElement(node, reclaim, birth, retire));
 			size++;
 		}
 
-		void erase (ListElement *key) {
-			ListElement *cur = head->next;
-			ListElement *pre = head;
-			while (cur != NULL) {
-				if (key->data == cur->data) {
-					pre->next = cur->next;
-					//delete cur->data;
-					size--;
-					break;
+		// with H = threads*K hazard pointers, scanning at 2H retired nodes
+		// frees at least half of them every time
+		int threshold () {
+			return max(R, 2*thread_number*K);
+		}
+
+		void scan () {
+			hazards.clear();
+			for (int i = 0;i < thread_number;i++) {
+				for (int j = 0;j < K;j++) {
+					void *hptr = HeadHPList[i].HP[j];
+					if (hptr != NULL) {
+						hazards.push_back(hptr);
+					}
 				}
-				pre = cur;
-				cur = cur->next;
 			}
-		}
+			sort(hazards.begin(), hazards.end());
 
-		void clearall() {
-			delete head;
-			head = new ListElement();
-			tail = head;
+			int kept = 0;
+			for (size_t i = 0;i < retired.size();i++) {
+				if (binary_search(hazards.begin(), hazards.end(), retired[i].data)) {
+					retired[kept++] = retired[i];
+				} else {
+					retired[i].reclaim(retired[i].data);
+				}
+			}
+			retired.resize(kept);
+			size = kept;
 		}
 
-		ListElement * gethead() {
-			return head->next;
-		}
+		// the IBR counterpart: a node stays while its [birth, retire]
+		// interval meets some thread's reserved [lower, upper]
+		void scan_eras () {
+			eras.clear();
+			for (int i = 0;i < thread_number;i++) {
+				unsigned long lower = ibr_record[i].lower;
+				unsigned long upper = ibr_record[i].upper;
+				if (lower <= upper) {
+					eras.push_back(lower);
+					eras.push_back(upper);
+				}
+			}
 
-		bool find (ListElement **key) {
-			if (*key == NULL) { return false; }
-			if (head == NULL) { return false; }
-			ListElement *cur = head->next;
-			while (cur != NULL) {
-				if (*key == NULL || cur == NULL) { return false; }
-				if ((*key)->data == cur->data) {
-					return true;
+			int kept = 0;
+			for (size_t i = 0;i < retired.size();i++) {
+				bool reserved = false;
+				for (size_t j = 0;j < eras.size();j += 2) {
+					if (retired[i].birth <= eras[j+1] && retired[i].retire >= eras[j]) {
+						reserved = true;
+						break;
+					}
+				}
+				if (reserved) {
+					retired[kept++] = retired[i];
+				} else {
+					retired[i].reclaim(retired[i].data);
 				}
-				cur = cur->next;
 			}
-			return false;
+			retired.resize(kept);
+			size = kept;
 		}
 
 		void show () {
-			ListElement *cur = head->next;
 			cout << "list: "; 
-			while (cur != NULL) {
-				cout << cur->data->value << " ";
-				cur = cur->next;
+			for (size_t i = 0;i < retired.size();i++) {
+				cout << retired[i].data << " ";
 			}
 			cout << endl;
 		}
 };
 
-class StackHazard {
-	private:
-		Node *top;
+// reclamation policies for the hazard containers. An operation runs
+// between enter and leave; protect publishes a node it is about to read,
+// and validate says whether the shared pointer has to be read again after
+// that. Both keep their state in the per-thread globals.
+class HPReclaim {
 	public:
-		StackHazard () {
-			top = new Node();
+		static const bool validate = true;
+
+		static void enter (int) {
 		}
 
-		~StackHazard () {
-			delete top;
+		static void leave (int thread_id) {
+			for (int i = 0;i < K;i++) {
+				HeadHPList[thread_id].HP[i] = NULL;
+			}
+		}
+
+		// the store must be visible before the pointer is read again
+		static void protect (int thread_id, int i, void *node) {
+			HeadHPList[thread_id].HP[i] = node;
+			__sync_synchronize();
+		}
+
+		template <class NodeType>
+		static void born (int, NodeType *) {
 		}
 
-		void retire (Node *node, int thread_id) {
-			retire_list[thread_id].insert(node);
-			if (retire_list[thread_id].size >= R) {
-				scan(thread_id);
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			retire_list[thread_id].insert(node, reclaim_node<NodeType>);
+			if (retire_list[thread_id].size >= retire_list[thread_id].threshold()) {
+				retire_list[thread_id].scan();
 			}
 		}
 
-		void scan (int thread_id) {
-			List *private_list = new List();
+		static long pending () {
+			long count = 0;
 			for (int i = 0;i < thread_number;i++) {
-				for (int j = 0;j < K;j++) {
-					Node *hptr = HeadHPList[i].HP[j];
-					if (hptr != NULL) {
-						private_list->insert(hptr);
-					}
+				count += retire_list[i].size;
+			}
+			return count;
+		}
+};
+
+// epoch-based reclamation (Fraser). enter announces the global epoch and
+// leave withdraws it; nothing is published per node. A node retired in
+// epoch e goes to limbo bucket e % EBR_LIMBO and is freed once the epoch
+// reaches e+2, since every thread active then entered after it was
+// unlinked. Every EBR_ADVANCE retires a thread tries to move the epoch
+// on, which only succeeds when no active thread is behind.
+class EBRReclaim {
+	private:
+		static void try_advance () {
+			unsigned long epoch = global_epoch;
+			for (int i = 0;i < thread_number;i++) {
+				unsigned long state = ebr_record[i].state;
+				if ((state & 1) && (state >> 1) != epoch) {
+					return ;
 				}
 			}
+			__sync_bool_compare_and_swap(&global_epoch, epoch, epoch+1);
+		}
+	public:
+		static const bool validate = false;
+
+		// read the epoch again after the announcement is visible, so an
+		// advance in between cannot leave us announcing an old one
+		static void enter (int thread_id) {
+			while (true) {
+				unsigned long epoch = global_epoch;
+				ebr_record[thread_id].state = epoch << 1 | 1;
+				__sync_synchronize();
+				if (global_epoch == epoch) {
+					return ;
+				}
+			}
+		}
+
+		static void leave (int thread_id) {
+			__asm__ __volatile__("" ::: "memory");
+			ebr_record[thread_id].state = 0;
+		}
+
+		static void protect (int, int, void *) {
+		}
 
-			ListElement *cur = retire_list[thread_id].gethead();
-			while (cur != NULL) {
-				if (private_list == NULL) {return ;}
-				if (!(private_list->find(&cur))) {
-					retire_list[thread_id].erase(cur);
+		template <class NodeType>
+		static void born (int, NodeType *) {
+		}
+
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			EBRRecord *rec = &ebr_record[thread_id];
+			unsigned long epoch = global_epoch;
+			for (int i = 0;i < EBR_LIMBO;i++) {
+				if (rec->limbo_epoch[i] + 2 <= epoch) {
+					limbo_list[thread_id*EBR_LIMBO+i].clear();
 				}
-				cur = cur->next;
 			}
+			rec->limbo_epoch[epoch % EBR_LIMBO] = epoch;
+			limbo_list[thread_id*EBR_LIMBO + epoch%EBR_LIMBO].insert(node, reclaim_node<NodeType>);
+			if (++rec->retired >= EBR_ADVANCE) {
+				rec->retired = 0;
+				try_advance();
+			}
+		}
+
+		static long pending () {
+			long count = 0;
+			for (int i = 0;i < thread_number*EBR_LIMBO;i++) {
+				count += limbo_list[i].size;
+			}
+			return count;
+		}
+};
+
+// interval-based reclamation (2GEIBR, Wen et al.). Nodes carry the era
+// they were born in and the era they were retired in; an operation
+// reserves the range of eras [lower, upper] it has read pointers in, and a
+// retired node is freed once its [birth, retire] interval meets nobody's
+// reservation. A stalled thread therefore only keeps the nodes that were
+// alive in its own range. protect widens upper to the current era and
+// needs a fence only when the era has moved since the last pointer.
+class IBRReclaim {
+	public:
+		static const bool validate = true;
+
+		template <class NodeType>
+		static void born (int thread_id, NodeType *node) {
+			node->birth_era = global_era;
+			if (++ibr_record[thread_id].allocated >= IBR_ERA_FREQ) {
+				ibr_record[thread_id].allocated = 0;
+				__sync_fetch_and_add(&global_era, 1);
+			}
+		}
+
+		static void enter (int thread_id) {
+			unsigned long era = global_era;
+			ibr_record[thread_id].lower = era;
+			ibr_record[thread_id].upper = era;
+			__sync_synchronize();
+		}
+
+		static void leave (int thread_id) {
+			__asm__ __volatile__("" ::: "memory");
+			ibr_record[thread_id].upper = 0;
+			ibr_record[thread_id].lower = ~0UL;
+		}
+
+		// the pointer was read before the era, so its birth is covered
+		static void protect (int thread_id, int, void *) {
+			unsigned long era = global_era;
+			if (ibr_record[thread_id].upper != era) {
+				ibr_record[thread_id].upper = era;
+				__sync_synchronize();
+			}
+		}
+
+		template <class NodeType>
+		static void retire (int thread_id, NodeType *node) {
+			era_list[thread_id].insert(node, reclaim_node<NodeType>, node->birth_era, global_era);
+			if (++ibr_record[thread_id].retired >= era_list[thread_id].threshold()) {
+				ibr_record[thread_id].retired = 0;
+				era_list[thread_id].scan_eras();
+			}
+		}
+
+		static long pending () {
+			long count = 0;
+			for (int i = 0;i < thread_number;i++) {
+				count += era_list[i].size;
+			}
+			return count;
+		}
+};
+
+
+// elimination array (Hendler, Shavit and Yerushalmi): a push that lost
+// the race on top parks its node in a random slot for a while, and a
+// pop that lost the race takes a parked node instead of retrying top.
+// Each thread searches range slots; a partner that never came shrinks
+// the range, a slot that was already busy widens it.
+template <typename T>
+class EliminationArray {
+	private:
+		typedef struct ElimSlot {
+			Node<T> * volatile item;
+			ElimSlot () {
+				item = NULL;
+			}
+		}__attribute__((aligned(64))) ElimSlot;
+
+		typedef struct ElimState {
+			int range;
+			unsigned int seed;
+			long hits;
+			ElimState () {
+				range = 1;
+				seed = 0;
+				hits = 0;
+			}
+		}__attribute__((aligned(64))) ElimState;
+
+		ElimSlot slots[ELIM_SIZE];
+		ElimState *states;
+
+		ElimSlot * pick_slot (ElimState *state) {
+			if (state->seed == 0) {
+				state->seed = (unsigned int)(unsigned long)state | 1;
+			}
+			state->seed ^= state->seed << 13;
+			state->seed ^= state->seed >> 17;
+			state->seed ^= state->seed << 5;
+			return &slots[state->seed % state->range];
+		}
+
+	public:
+		EliminationArray () {
+			states = new ElimState[thread_number];
+		}
+
+		~EliminationArray () {
+			delete [] states;
+		}
+
+		// true if a pop took the node
+		bool push (Node<T> *node, int thread_id) {
+			ElimState *state = &states[thread_id];
+			ElimSlot *slot = pick_slot(state);
+			if (slot->item != NULL || !__sync_bool_compare_and_swap(&slot->item, (Node<T> *)NULL, node)) {
+				state->range = min(ELIM_SIZE, state->range+1);
+				return false;
+			}
+			for (int i = 0;i < ELIM_SPINS;i++) {
+				if (slot->item != node) {
+					break;
+				}
+				cpu_relax();
+			}
+			if (__sync_bool_compare_and_swap(&slot->item, node, (Node<T> *)NULL)) {
+				state->range = max(1, state->range/2);
+				return false;
+			}
+			// the pop left ELIM_TAKEN behind, we own the slot until we clear it
+			__atomic_store_n(&slot->item, (Node<T> *)NULL, __ATOMIC_RELEASE);
+			state->hits++;
+			return true;
+		}
+
+		// a parked node, or NULL if there was none
+		Node<T> * pop (int thread_id) {
+			ElimState *state = &states[thread_id];
+			ElimSlot *slot = pick_slot(state);
+			Node<T> *node = slot->item;
+			if (node == NULL || node == ELIM_TAKEN) {
+				state->range = max(1, state->range/2);
+				return NULL;
+			}
+			if (!__sync_bool_compare_and_swap(&slot->item, node, ELIM_TAKEN)) {
+				state->range = min(ELIM_SIZE, state->range+1);
+				return NULL;
+			}
+			state->hits++;
+			return node;
+		}
 
-			delete private_list;
+		long hits () {
+			long total = 0;
+			for (int i = 0;i < thread_number;i++) {
+				total += states[i].hits;
+			}
+			return total;
 		}
+};
 
-		void push (int val, int thread_id) {
-			Node *new_node = new Node(val);
-			Node *old_top;
+template <typename T, class Reclaim = HPReclaim>
+class StackHazard {
+	private:
+		int backoff;
+		Node<T> *top;
+		Node<T> *bottom;
+		EliminationArray<T> *elimination;
+	public:
+		StackHazard () {
+			backoff = backoff_method;
+			elimination = NULL;
+			top = NodeSlab<Node<T> >::alloc();
+			bottom = top;
+		}
+
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
+		void enable_elimination () {
+			elimination = new EliminationArray<T>();
+		}
+
+		long eliminated () {
+			return (elimination == NULL) ? 0 : elimination->hits();
+		}
+
+		// retired nodes are left to later scans, only linked ones are freed
+		~StackHazard () {
+			delete elimination;
+			while (top != NULL) {
+				Node<T> *next = top->next;
+				NodeSlab<Node<T> >::recycle(top);
+				top = next;
+			}
+		}
+
+		void retire (Node<T> *node, int thread_id) {
+			Reclaim::retire(thread_id, node);
+		}
+
+		// old_top is only compared, never read through, so a push needs no
+		// protection from the reclamation scheme
+		template <typename... Args>
+		void emplace (int thread_id, Args&&... args) {
+			Backoff bo(backoff);
+			Node<T> *new_node = NodeSlab<Node<T> >::alloc(std::forward<Args>(args)...);
+			Reclaim::born(thread_id, new_node);
+			Node<T> *old_top;
 			while (true) {
 				old_top = top;
-				HeadHPList[thread_id].HP[0] = old_top;
-				if (top != old_top) {
-					backoff();
-					continue;
-				}
 				new_node->next = old_top;
 				if (__sync_bool_compare_and_swap(&top, old_top, new_node)) {
 					break;
 				}
-				backoff();
+				if (elimination == NULL) {
+					bo.wait();
+				} else if (elimination->push(new_node, thread_id)) {
+					break;
+				}
 			}
-			HeadHPList[thread_id].HP[0] = NULL;
 		}
 
-		
-		Node * pop (int thread_id) {
-			Node *old_top, *old_next;
-			Node *data = NULL;
+		void push (T val, int thread_id) {
+			emplace(thread_id, std::move(val));
+		}
+
+		// the value is moved out while HP[1] still covers the node, then the
+		// node goes to retire. old_next is never read through, so it needs
+		// no hazard pointer.
+		bool pop (T *out, int thread_id) {
+			Reclaim::enter(thread_id);
+			Backoff bo(backoff);
+			Node<T> *old_top, *old_next;
+			Node<T> *data = NULL;
 			while (true) {
 				old_top = top;
-				HeadHPList[thread_id].HP[1] = old_top;
-				if (top != old_top) {
-					backoff();
+				Reclaim::protect(thread_id, 1, old_top);
+				if (Reclaim::validate && top != old_top) {
+					bo.wait();
 					continue;
 				}
 
 				old_next = old_top->next;
 
-				HeadHPList[thread_id].HP[2] = old_next;
-				if (top != old_top) {
-					backoff();
-					continue;
-				}
-
 				if (old_next == NULL) {
-					return NULL;
+					Reclaim::leave(thread_id);
+					return false;
 				}
 
 				if (__sync_bool_compare_and_swap(&top, old_top, old_next)) {
 					data = old_top;
 					break;
 				} 
-				backoff();
+				if (elimination == NULL) {
+					bo.wait();
+				} else if ((data = elimination->pop(thread_id)) != NULL) {
+					// the node never entered the stack, so nobody else can see it
+					Reclaim::leave(thread_id);
+					*out = std::move(data->value);
+					NodeSlab<Node<T> >::recycle(data);
+					return true;
+				}
 			}
 			//cout << "old_top: " << old_top << endl;
+			*out = std::move(data->value);
 			retire(old_top, thread_id);
-			HeadHPList[thread_id].HP[1] = NULL;
-			HeadHPList[thread_id].HP[2] = NULL;
-			return data;
+			Reclaim::leave(thread_id);
+			return true;
+		}
+
+		// first..last are already linked through next, one CAS puts them on
+		// top; like push it only compares old_top. Chains work on the nodes
+		// and leave their values alone. The nodes must be fresh: one that
+		// came out of pop_all may still be read by a pop holding a hazard
+		// pointer to it.
+		void push_chain (Node<T> *first, Node<T> *last) {
+			Backoff bo(backoff);
+			Node<T> *old_top;
+			while (true) {
+				old_top = top;
+				last->next = old_top;
+				if (__sync_bool_compare_and_swap(&top, old_top, first)) {
+					break;
+				}
+				bo.wait();
+			}
+		}
+
+		// detach every node with one exchange, top first. The chain still
+		// ends at the bottom sentinel, so walking it stops at chain_end()
+		// and draining costs one exchange however deep the stack is.
+		// Other pops may still hold hazard pointers to these nodes, so give
+		// them back through retire_chain rather than delete.
+		Node<T> * pop_all () {
+			return __sync_lock_test_and_set(&top, bottom);
+		}
+
+		Node<T> * chain_end () {
+			return bottom;
+		}
+
+		void retire_chain (Node<T> *chain, int thread_id) {
+			while (chain != bottom) {
+				Node<T> *next = chain->next;
+				retire(chain, thread_id);
+				chain = next;
+			}
 		}
 		
 };
@@ -259,7 +884,7 @@ class StackHazard {
 
 void test_time () {
 	double tstart = 0.0, ttaken = 0.0;
-	StackHazard s_lock_free_hazard;
+	StackHazard<int> s_lock_free_hazard;
 	tstart = omp_get_wtime();
 
 	# pragma omp parallel for 
@@ -276,14 +901,15 @@ void test_time () {
 	tstart = omp_get_wtime();
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		s_lock_free_hazard.pop(omp_get_thread_num());
+		int val;
+		s_lock_free_hazard.pop(&val, omp_get_thread_num());
 	}
 	ttaken = omp_get_wtime() - tstart;
 	cout << "pop time: " << ttaken << endl;
 }
 
 void test_push_correct () {
-	StackHazard s_lock_free_hazard;
+	StackHazard<int> s_lock_free_hazard;
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		s_lock_free_hazard.push(i, omp_get_thread_num());
@@ -293,19 +919,19 @@ void test_push_correct () {
 	int count = 0;
 	
 	for (int i = 1;i <= N;i++) {
-		Node *pop_val = s_lock_free_hazard.pop(omp_get_thread_num());
-		if (pop_val == NULL) {
+		int pop_val;
+		if (!s_lock_free_hazard.pop(&pop_val, omp_get_thread_num())) {
 			break;
 		}
 		count++;
 		
-		if (correct_check[pop_val->value] == 0) {
+		if (correct_check[pop_val] == 0) {
 			cout << "Unseen variable" << endl;
 			return ;
 		}
 		
-		correct_check[pop_val->value]--;
-		if (correct_check[pop_val->value] < 0) {
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
 			cout << "Multiple variable" << endl;
 			return ;
 		}
@@ -320,7 +946,7 @@ void test_push_correct () {
 }
 
 void test_pop_correct () {
-	StackHazard s_lock_free_hazard;
+	StackHazard<int> s_lock_free_hazard;
 	for (int i = 1;i <= N;i++) {
 		s_lock_free_hazard.push(i, omp_get_thread_num());
 	}
@@ -328,8 +954,9 @@ void test_pop_correct () {
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
 		int thread_id = omp_get_thread_num();
-		Node *data = s_lock_free_hazard.pop(thread_id);
-		correct_thread[thread_id].push_back(data->value);
+		int data;
+		s_lock_free_hazard.pop(&data, thread_id);
+		correct_thread[thread_id].push_back(data);
 	}
 
 	int count = 0;
@@ -356,8 +983,349 @@ void test_pop_correct () {
 	cout << "Pop Correct" << endl;
 }
 
+// the same workload as test_time once for every backoff strategy
+void test_backoff () {
+	const char *names[] = {"none", "exponential", "proportional"};
+	for (int method = BACKOFF_NONE;method <= BACKOFF_PROP;method++) {
+		double tstart = 0.0, push_time = 0.0, pop_time = 0.0;
+		StackHazard<int> s_lock_free_hazard;
+		s_lock_free_hazard.set_backoff(method);
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_hazard.push(i, omp_get_thread_num());
+		}
+		push_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			s_lock_free_hazard.pop(&val, omp_get_thread_num());
+		}
+		pop_time = omp_get_wtime() - tstart;
+		cout << names[method] << " backoff, push time: " << push_time << " , pop time: " << pop_time << endl;
+	}
+}
+
+// pushes and pops interleaved on a prefilled stack, with and without
+// the elimination array
+void test_elimination () {
+	for (int elim = 0;elim <= 1;elim++) {
+		double tstart = 0.0, ttaken = 0.0;
+		StackHazard<int> s_lock_free_hazard;
+		if (elim) {
+			s_lock_free_hazard.enable_elimination();
+		}
+		for (int i = 1;i <= 1000;i++) {
+			s_lock_free_hazard.push(i, omp_get_thread_num());
+		}
+		for (int i = 0;i < thread_number;i++) {
+			correct_thread[i].clear();
+		}
+
+		long empty = 0;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for reduction(+:empty)
+		for (int i = 1001;i <= N;i++) {
+			if (i&1) {
+				s_lock_free_hazard.push(i, omp_get_thread_num());
+			} else {
+				int thread_id = omp_get_thread_num();
+				int data;
+				if (!s_lock_free_hazard.pop(&data, omp_get_thread_num())) {
+					empty++;
+				} else {
+					correct_thread[thread_id].push_back(data);
+				}
+			}
+		}
+		ttaken = omp_get_wtime() - tstart;
+		cout << (elim ? "elimination" : "no elimination") << " mix time: " << ttaken << " , eliminated: " << s_lock_free_hazard.eliminated() << " , empty pops: " << empty << endl;
+
+		// every pushed value must come out exactly once
+		vector<int> seen(N+1, 0);
+		int data;
+		while (s_lock_free_hazard.pop(&data, omp_get_thread_num())) {
+			seen[data]++;
+		}
+		for (int i = 0;i < thread_number;i++) {
+			for (size_t j = 0;j < correct_thread[i].size();j++) {
+				seen[correct_thread[i][j]]++;
+			}
+		}
+		for (int i = 1;i <= N;i++) {
+			if (seen[i] != ((i <= 1000 || (i&1)) ? 1 : 0)) {
+				cout << "Mix incorrect at " << i << endl;
+				return ;
+			}
+		}
+		cout << "Mix Correct" << endl;
+	}
+}
+
+// draining the stack one pop at a time against a single pop_all, then
+// push_chain batches racing with pop_all
+void test_pop_all () {
+	double tstart = 0.0, pop_time = 0.0, pop_all_time = 0.0;
+	{
+		StackHazard<int> s_lock_free_hazard;
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_hazard.push(i, 0);
+		}
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			s_lock_free_hazard.pop(&val, omp_get_thread_num());
+		}
+		pop_time = omp_get_wtime() - tstart;
+	}
+	{
+		StackHazard<int> s_lock_free_hazard;
+		for (int i = 1;i <= N;i++) {
+			s_lock_free_hazard.push(i, 0);
+		}
+		tstart = omp_get_wtime();
+		Node<int> *chain = s_lock_free_hazard.pop_all();
+		pop_all_time = omp_get_wtime() - tstart;
+		int count = 0;
+		for (Node<int> *cur = chain;cur != s_lock_free_hazard.chain_end();cur = cur->next) {
+			count++;
+		}
+		s_lock_free_hazard.retire_chain(chain, 0);
+		if (count != N) {
+			cout << "pop_all number: " << count << " , sample number: " << N << endl;
+			return ;
+		}
+	}
+	cout << "pop time: " << pop_time << " , pop_all time: " << pop_all_time << endl;
+
+	StackHazard<int> s_lock_free_hazard;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	tstart = omp_get_wtime();
+	# pragma omp parallel for schedule(static, 1)
+	for (int i = 1;i <= N;i += CHAIN_LEN) {
+		int thread_id = omp_get_thread_num();
+		Node<int> *first = NULL, *last = NULL;
+		for (int j = 0;j < CHAIN_LEN && i+j <= N;j++) {
+			Node<int> *node = NodeSlab<Node<int> >::alloc(i+j);
+			if (last == NULL) {
+				first = last = node;
+			} else {
+				last->next = node;
+				last = node;
+			}
+		}
+		s_lock_free_hazard.push_chain(first, last);
+		if ((i/CHAIN_LEN) % 8 == 0) {
+			Node<int> *chain = s_lock_free_hazard.pop_all();
+			for (Node<int> *cur = chain;cur != s_lock_free_hazard.chain_end();cur = cur->next) {
+				correct_thread[thread_id].push_back(cur->value);
+			}
+			s_lock_free_hazard.retire_chain(chain, thread_id);
+		}
+	}
+	cout << "push_chain/pop_all time: " << omp_get_wtime() - tstart << endl;
+
+	vector<int> seen(N+1, 0);
+	Node<int> *chain = s_lock_free_hazard.pop_all();
+	for (Node<int> *cur = chain;cur != s_lock_free_hazard.chain_end();cur = cur->next) {
+		seen[cur->value]++;
+	}
+	s_lock_free_hazard.retire_chain(chain, 0);
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			seen[correct_thread[i][j]]++;
+		}
+	}
+	for (int i = 1;i <= N;i++) {
+		if (seen[i] != 1) {
+			cout << "Chain incorrect at " << i << endl;
+			return ;
+		}
+	}
+	cout << "Chain Correct" << endl;
+}
+
+// the same code over a cache-line sized message and over a move-only
+// unique_ptr, which has to be moved in and out of the nodes
+void test_generic () {
+	double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+	{
+		StackHazard<Message> s_lock_free_hazard;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg{};
+			msg.id = i;
+			s_lock_free_hazard.push(msg, omp_get_thread_num());
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg;
+			s_lock_free_hazard.pop(&msg, omp_get_thread_num());
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "64-byte message, push time: " << enqueue_time << " , pop time: " << dequeue_time << endl;
+	}
+
+	StackHazard<unique_ptr<int> > s_lock_free_hazard;
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		s_lock_free_hazard.emplace(omp_get_thread_num(), new int(i));
+	}
+	# pragma omp parallel 
+	{
+		unique_ptr<int> data;
+		while (s_lock_free_hazard.pop(&data, omp_get_thread_num())) {
+			correct_thread[omp_get_thread_num()].push_back(*data);
+		}
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			if (seen[correct_thread[i][j]]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != N) {
+		cout << "Pop number: " << total << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Generic Correct" << endl;
+}
+
+// 100M operations in FLAT_ROUNDS rounds of push/pop pairs on one stack;
+// resident memory and the nodes still waiting in the retire lists should
+// stay flat from round to round
+long resident_kb () {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void test_reclaim () {
+	StackHazard<int> s_lock_free_hazard;
+	long per_round = FLAT_OPS / FLAT_ROUNDS;
+	for (int round = 1;round <= FLAT_ROUNDS;round++) {
+		double tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (long i = 0;i < per_round/2;i++) {
+			int data;
+			s_lock_free_hazard.push(i, omp_get_thread_num());
+			s_lock_free_hazard.pop(&data, omp_get_thread_num());
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		long retired = 0;
+		for (int i = 0;i < thread_number;i++) {
+			retired += retire_list[i].size;
+		}
+		cout << "ops: " << round*per_round << " , rss: " << resident_kb() << " KB , retired: " << retired << " , time: " << ttaken << endl;
+	}
+}
+
+// push/pop pairs under each reclamation policy: the time with every
+// thread running, then the peak of retired but unfreed nodes while thread
+// 0 sits inside an operation until the others are done. Under HP a
+// stalled thread can only pin its K hazard pointers, so it is not made to
+// hold any here.
+template <class Reclaim>
+void test_domain (const char *name) {
+	double tstart = omp_get_wtime();
+	{
+		StackHazard<int, Reclaim> s_lock_free_hazard;
+		# pragma omp parallel for 
+		for (int i = 0;i < N;i++) {
+			int data;
+			s_lock_free_hazard.push(i, omp_get_thread_num());
+			s_lock_free_hazard.pop(&data, omp_get_thread_num());
+		}
+	}
+	double ttaken = omp_get_wtime() - tstart;
+
+	StackHazard<int, Reclaim> s_lock_free_hazard;
+	volatile int running = thread_number - 1;
+	long base = Reclaim::pending(), peak = 0;
+	# pragma omp parallel
+	{
+		int thread_id = omp_get_thread_num();
+		if (thread_id == 0) {
+			Reclaim::enter(thread_id);
+			while (running > 0) {
+				peak = max(peak, Reclaim::pending() - base);
+				usleep(STALL_SAMPLE);
+			}
+			Reclaim::leave(thread_id);
+		} else {
+			for (int i = 0;i < N/(thread_number-1);i++) {
+				int data;
+				s_lock_free_hazard.push(i, thread_id);
+				s_lock_free_hazard.pop(&data, thread_id);
+			}
+			__sync_fetch_and_sub(&running, 1);
+		}
+	}
+	cout << name << ", time: " << ttaken << " , peak unreclaimed with a stalled thread: " << peak << " nodes (" << peak*sizeof(Node<int>)/1024 << " KB)" << endl;
+}
+
+void test_reclaim_domain () {
+	if (thread_number < 2) {
+		cout << "reclamation test needs at least 2 threads" << endl;
+		return ;
+	}
+	test_domain<HPReclaim>("hazard pointers");
+	test_domain<EBRReclaim>("epochs");
+	test_domain<IBRReclaim>("interval eras");
+}
+
+// cost of one node allocation plus its free, new/delete against the
+// slab. Every thread allocates a block of nodes and frees every
+// thread_number-th one, so most frees cross threads the way dequeues do
+void test_alloc () {
+	Node<int> **nodes = new Node<int> *[N];
+	for (int slab = 0;slab <= 1;slab++) {
+		double tstart = omp_get_wtime();
+		for (int round = 0;round < ALLOC_ROUNDS;round++) {
+			# pragma omp parallel for schedule(static)
+			for (int i = 0;i < N;i++) {
+				nodes[i] = slab ? NodeSlab<Node<int> >::alloc(i) : new Node<int>(i);
+			}
+			# pragma omp parallel for schedule(static, 1)
+			for (int i = 0;i < N;i++) {
+				if (slab) {
+					NodeSlab<Node<int> >::recycle(nodes[i]);
+				} else {
+					delete nodes[i];
+				}
+			}
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		cout << (slab ? "slab" : "new/delete") << " alloc+free: " << ttaken*1e9/((double)N*ALLOC_ROUNDS) << " ns per node" << endl;
+	}
+	cout << "slab chunks: " << NodeSlab<Node<int> >::chunks() << " of " << SLAB_NODES << " nodes" << endl;
+	delete [] nodes;
+}
+
 int main (int argc, char *argv[]) {
-	if (argc < 3 || argc > 3) {
+	if (argc < 3 || argc > 4) {
 		printf("error argument number\n");
 		return 0;
 	}
@@ -369,9 +1337,14 @@ int main (int argc, char *argv[]) {
 	thread_number = atoi(argv[1]);
 	correct_thread = new vector<int>[thread_number];
 	int test_method = atoi(argv[2]);
+	backoff_method = (argc > 3) ? atoi(argv[3]) : BACKOFF_EXP;
 
 	HeadHPList = new HPList[thread_number];
 	retire_list = new List[thread_number];
+	ebr_record = new EBRRecord[thread_number];
+	limbo_list = new List[thread_number*EBR_LIMBO];
+	ibr_record = new IBRRecord[thread_number];
+	era_list = new List[thread_number];
 
 	omp_set_num_threads(thread_number);
 
@@ -385,6 +1358,27 @@ int main (int argc, char *argv[]) {
 		case 3:
 			test_pop_correct();
 			break;
+		case 4:
+			test_backoff();
+			break;
+		case 5:
+			test_elimination();
+			break;
+		case 6:
+			test_pop_all();
+			break;
+		case 7:
+			test_generic();
+			break;
+		case 8:
+			test_reclaim();
+			break;
+		case 9:
+			test_reclaim_domain();
+			break;
+		case 10:
+			test_alloc();
+			break;
 		default:
 			printf("error test method\n");
 			return 0;
@@ -0,0 +1,474 @@
+#include <iostream>
+#include <cstdlib>
+#include <stdint.h>
+#include <stdbool.h>
+#include <omp.h>
+#include <unistd.h>
+#include <time.h>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+#ifndef __x86_64
+	#error "the CRQ cells need the 16-byte cmpxchg16b"
+#endif
+
+#define N 1000000
+#define CRQ_SIZE 1024
+#define CRQ_PATIENCE 16
+#define CRQ_EMPTY ((uint64_t)-1)
+#define CRQ_SAFE (1UL<<63)
+#define CRQ_CLOSED (1UL<<63)
+#define LCRQ_RETIRE 8
+#define MAX_THREADS 64
+
+int thread_number;
+map<int, int> correct_check;
+vector<int> *correct_thread;
+
+/////////////////////////////////////////////////////
+/* structure definition */
+
+// idx is the round the cell serves, with CRQ_SAFE in the top bit;
+// the pair is only ever changed with one cmpxchg16b
+typedef struct CRQCell {
+	volatile uint64_t idx;
+	volatile uint64_t val;
+
+	CRQCell () {
+		idx = CRQ_SAFE;
+		val = CRQ_EMPTY;
+	}
+}__attribute__((aligned(64))) CRQCell;
+
+
+struct CRQ;
+
+typedef struct HazardSlot {
+	struct CRQ * volatile crq;
+
+	HazardSlot () {
+		crq = NULL;
+	}
+}__attribute__((aligned(64))) HazardSlot;
+
+
+/////////////////////////////////////////////////////
+/* global inline function */
+
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+inline static bool CAS_ASM_64(volatile uint64_t target[2], uint64_t compare[2], uint64_t set[2]) {
+	bool z;
+	__asm__ __volatile__("movq 0(%4), %%rax;"
+			     "movq 8(%4), %%rdx;"
+			     "lock;" "cmpxchg16b %0; setz %1"
+				: "+m" (*target),
+				  "=q" (z)
+				: "b"  (set[0]),
+				  "c"  (set[1]),
+				  "q"  (compare)
+				: "memory", "cc", "%rax", "%rdx");
+	return z;
+}
+
+inline static bool CAS_CELL (CRQCell *cell, uint64_t old_idx, uint64_t old_val, uint64_t new_idx, uint64_t new_val) {
+	uint64_t compare[2] = {old_idx, old_val};
+	uint64_t set[2] = {new_idx, new_val};
+	return CAS_ASM_64((uint64_t *)cell, compare, set);
+}
+
+/////////////////////////////////////////////////////
+/* class definition */
+
+// concurrent ring queue (Morrison and Afek): threads claim a cell with
+// fetch-and-add on head or tail and settle the race for it with one
+// cmpxchg16b. A ring that fills up, or whose enqueuers keep losing,
+// sets CRQ_CLOSED in tail and the enqueuer moves on to a new ring.
+typedef struct CRQ {
+	volatile uint64_t head __attribute__((aligned(64)));
+	volatile uint64_t tail __attribute__((aligned(64)));
+	struct CRQ * volatile next __attribute__((aligned(64)));
+	CRQCell ring[CRQ_SIZE];
+
+	CRQ () {
+		head = 0;
+		tail = 0;
+		next = NULL;
+		for (int i = 0;i < CRQ_SIZE;i++) {
+			ring[i].idx = CRQ_SAFE | i;
+		}
+	}
+
+	// false once the ring is closed
+	bool enqueue (int val) {
+		for (int tries = 0;;tries++) {
+			uint64_t t = __sync_fetch_and_add(&tail, 1);
+			if (t & CRQ_CLOSED) {
+				return false;
+			}
+			CRQCell *cell = &ring[t%CRQ_SIZE];
+			uint64_t idx = cell->idx;
+			uint64_t v = cell->val;
+			if (v == CRQ_EMPTY && (idx & ~CRQ_SAFE) <= t && ((idx & CRQ_SAFE) || head <= t)) {
+				if (CAS_CELL(cell, idx, CRQ_EMPTY, CRQ_SAFE | t, (unsigned int)val)) {
+					return true;
+				}
+			}
+			if ((int64_t)(t-head) >= CRQ_SIZE || tries >= CRQ_PATIENCE) {
+				__sync_fetch_and_or(&tail, CRQ_CLOSED);
+				return false;
+			}
+		}
+	}
+
+	// false if the ring is empty
+	bool dequeue (int *val) {
+		while (true) {
+			uint64_t h = __sync_fetch_and_add(&head, 1);
+			CRQCell *cell = &ring[h%CRQ_SIZE];
+			while (true) {
+				uint64_t idx = cell->idx;
+				uint64_t v = cell->val;
+				uint64_t safe = idx & CRQ_SAFE;
+				idx &= ~CRQ_SAFE;
+				if (idx > h) {
+					break;
+				}
+				if (v != CRQ_EMPTY) {
+					if (idx == h) {
+						if (CAS_CELL(cell, safe | h, v, safe | (h+CRQ_SIZE), CRQ_EMPTY)) {
+							*val = (int)v;
+							return true;
+						}
+					} else if (CAS_CELL(cell, safe | idx, v, idx, v)) {
+						// an older value still sits here, keep the enqueuer
+						// of round h away by marking the cell unsafe
+						break;
+					}
+				} else if (CAS_CELL(cell, safe | idx, CRQ_EMPTY, safe | (h+CRQ_SIZE), CRQ_EMPTY)) {
+					break;
+				}
+			}
+			uint64_t t = tail & ~CRQ_CLOSED;
+			if (t <= h+1) {
+				fix_state();
+				return false;
+			}
+		}
+	}
+
+	// dequeuers that ran past tail pull it forward again
+	void fix_state () {
+		while (true) {
+			uint64_t t = tail;
+			uint64_t h = head;
+			if (tail != t) {
+				continue;
+			}
+			if (h <= t) {
+				return;
+			}
+			if (__sync_bool_compare_and_swap(&tail, t, h)) {
+				return;
+			}
+		}
+	}
+} CRQ;
+
+
+// LCRQ: a linked list of CRQs. Rings are unlinked from the head once
+// drained and freed through hazard pointers, one per thread.
+class QueueLCRQ {
+	private:
+		CRQ * volatile head_crq __attribute__((aligned(64)));
+		CRQ * volatile tail_crq __attribute__((aligned(64)));
+		HazardSlot *hazard;
+		vector<CRQ *> *retired;
+
+		CRQ * protect (CRQ * volatile *src, int thread_id) {
+			while (true) {
+				CRQ *crq = *src;
+				hazard[thread_id].crq = crq;
+				__sync_synchronize();
+				if (*src == crq) {
+					return crq;
+				}
+			}
+		}
+
+		void retire (CRQ *crq, int thread_id) {
+			retired[thread_id].push_back(crq);
+			if (retired[thread_id].size() < LCRQ_RETIRE) {
+				return ;
+			}
+			vector<CRQ *> keep;
+			for (size_t i = 0;i < retired[thread_id].size();i++) {
+				CRQ *old = retired[thread_id][i];
+				bool in_use = false;
+				for (int j = 0;j < thread_number;j++) {
+					if (hazard[j].crq == old) {
+						in_use = true;
+						break;
+					}
+				}
+				if (in_use) {
+					keep.push_back(old);
+				} else {
+					delete old;
+				}
+			}
+			retired[thread_id].swap(keep);
+		}
+
+	public:
+
+		QueueLCRQ () {
+			head_crq = new CRQ();
+			tail_crq = head_crq;
+			hazard = new HazardSlot[thread_number];
+			retired = new vector<CRQ *>[thread_number];
+		}
+
+		~QueueLCRQ () {
+			while (head_crq != NULL) {
+				CRQ *next = head_crq->next;
+				delete head_crq;
+				head_crq = next;
+			}
+			for (int i = 0;i < thread_number;i++) {
+				for (size_t j = 0;j < retired[i].size();j++) {
+					delete retired[i][j];
+				}
+			}
+			delete [] retired;
+			delete [] hazard;
+		}
+
+		void enqueue (int val) {
+			int thread_id = omp_get_thread_num();
+			while (true) {
+				CRQ *crq = protect(&tail_crq, thread_id);
+				CRQ *next = crq->next;
+				if (next != NULL) {
+					__sync_bool_compare_and_swap(&tail_crq, crq, next);
+					continue;
+				}
+				if (crq->enqueue(val)) {
+					break;
+				}
+				CRQ *new_crq = new CRQ();
+				new_crq->enqueue(val);
+				if (__sync_bool_compare_and_swap(&crq->next, (CRQ *)NULL, new_crq)) {
+					__sync_bool_compare_and_swap(&tail_crq, crq, new_crq);
+					break;
+				}
+				delete new_crq;
+			}
+			hazard[thread_id].crq = NULL;
+		}
+
+		bool dequeue (int *val) {
+			int thread_id = omp_get_thread_num();
+			bool found = false;
+			while (true) {
+				CRQ *crq = protect(&head_crq, thread_id);
+				if (crq->dequeue(val)) {
+					found = true;
+					break;
+				}
+				CRQ *next = crq->next;
+				if (next == NULL) {
+					break;
+				}
+				// an enqueuer may have slipped in before the ring closed
+				if (crq->dequeue(val)) {
+					found = true;
+					break;
+				}
+				// tail_crq must not point at a ring we are about to retire
+				__sync_bool_compare_and_swap(&tail_crq, crq, next);
+				if (__sync_bool_compare_and_swap(&head_crq, crq, next)) {
+					hazard[thread_id].crq = NULL;
+					retire(crq, thread_id);
+				}
+			}
+			hazard[thread_id].crq = NULL;
+			return found;
+		}
+		
+};
+
+/////////////////////////////////////////////////////
+/* main */
+
+void test_time () {
+	double tstart = 0.0, ttaken = 0.0;
+	QueueLCRQ q_lcrq;
+	tstart = omp_get_wtime();
+
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_lcrq.enqueue(i);
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "enqueue time: " << ttaken << endl;
+		
+	usleep(1000);
+
+	tstart = 0.0;
+	ttaken = 0.0;
+	tstart = omp_get_wtime();
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		q_lcrq.dequeue(&val);
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "dequeue time: " << ttaken << endl;
+}
+
+void test_enqueue_correct () {
+	QueueLCRQ q_lcrq;
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_lcrq.enqueue(i);
+	}
+
+	int count = 0;
+	for (int i = 1;i <= N;i++) {
+		int pop_val;
+		if (!q_lcrq.dequeue(&pop_val)) {
+			break;
+		}
+		count++;
+		
+		if (correct_check[pop_val] == 0) {
+			cout << "Unseen variable" << endl;
+			return ;
+		}
+		
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
+			cout << "Multiple variable" << endl;
+			return ;
+		}
+		
+	}
+	
+	if (count != N) {
+		cout << "Enqueue number: " << count << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Enqueue Correct" << endl;
+}
+
+void test_dequeue_correct () {
+	QueueLCRQ q_lcrq;
+	for (int i = 1;i <= N;i++) {
+		q_lcrq.enqueue(i);
+	}
+
+	usleep(1000);
+
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		if (q_lcrq.dequeue(&val)) {
+			correct_thread[omp_get_thread_num()].push_back(val);
+		}
+	}
+	
+	int count = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			count++;
+			int pop_val = correct_thread[i][j];
+			if (correct_check[pop_val] == 0) {
+				cout << "Unseen variable " << pop_val << endl;
+				return ;
+			}
+			correct_check[pop_val]--;
+			if (correct_check[pop_val] < 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	
+	if (count != N) {
+		cout << "Dequeue number: " << count << " , Sample number: " << N << endl;
+		return ;
+	}
+	
+	cout << "Dequeue Correct" << endl;
+}
+
+// enqueue and dequeue times from 1 to MAX_THREADS threads
+void test_scaling () {
+	for (int threads = 1;threads <= MAX_THREADS;threads *= 2) {
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		thread_number = threads;
+		omp_set_num_threads(threads);
+		QueueLCRQ q_lcrq;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			q_lcrq.enqueue(i);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			q_lcrq.dequeue(&val);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << threads << " threads, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3 || argc > 3) {
+		printf("error argument number\n");
+		return 0;
+	}
+
+	for (int i = 1;i <= N;i++) {
+		correct_check[i] = 1;
+	}
+	
+	thread_number = atoi(argv[1]);
+	correct_thread = new vector<int>[thread_number];
+	int test_method = atoi(argv[2]);
+
+	omp_set_num_threads(thread_number);
+
+	switch (test_method) {
+		case 1:
+			test_time();
+			break;
+		case 2:
+			test_enqueue_correct();
+			break;
+		case 3:
+			test_dequeue_correct();
+			break;
+		case 4:
+			test_scaling();
+			break;
+		default:
+			printf("error test method\n");
+			return 0;
+	}
+
+	return 0;
+}
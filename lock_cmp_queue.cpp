@@ -1,76 +1,615 @@
 #include <iostream>
 #include <cstdlib>
 #include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <omp.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <thread>
 #include <map>
 #include <vector>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
 #define N 1000000
-#define MIN_DELAY 1
-#define MAX_DELAY 64
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+#define TICKET_DELAY 64
+#define TICKET_SLOTS 8
+#define COHORT_PASS_LIMIT 64
+#define CLH_TAG_SHIFT 48
+#define ADAPTIVE_MAX_SPIN 1000
+#define OVERSUB_TIME 2.0
+#define READ_PERCENT 90
+#define FC_PASSES 4
+#define DELEGATE_YIELD 64
+#define MCS_WAITING 0
+#define MCS_GRANTED 1
+#define MCS_ABANDONED 2
+#define STAT_BUCKETS 24
+#define TRY_TIMEOUT 1e-5
+#define FC_NONE 0
+#define FC_INSERT 1
+#define FC_REMOVE 2
+#define PF_RINC 0x100
+#define PF_WBITS 0x3
+#define PF_PRES 0x2
+#define PF_PHID 0x1
 #define AVG_TIMES 20
+#define CACHE_LINE 64
+#define SLAB_NODES 1024
+#define SLAB_BATCH 64
+#define ALLOC_ROUNDS 10
 
 int thread_number;
 int lock_method;
+int exec_method;
+int backoff_method;
 map<int, int> correct_check;
 vector<int> *correct_thread;
 
 /////////////////////////////////////////////////////
 /* structure definition */
 
-typedef struct Node {
-	int value;
+template <typename T>
+struct Node {
+	T value;
 	struct Node *next;
 	
-	Node () {
-		value = 0;
+	Node () : value() {
 		next = NULL;
 	}
 
-	Node (int val) {
-		value = val;
+	// the value is built in place from whatever enqueue was given
+	template <typename... Args>
+	Node (Args&&... args) : value(std::forward<Args>(args)...) {
 		next = NULL;
 	}
-} Node;
+};
+
+// a cache-line sized payload for test_generic
+typedef struct Message {
+	int id;
+	char payload[60];
+} Message;
 
 
 typedef struct MCSNode {
-	int flag;
-	struct MCSNode *next;
+	volatile int flag;
+	struct MCSNode * volatile next;
 
 	MCSNode () {
-		flag = 1;
+		flag = MCS_GRANTED;
+		next = NULL;
+	}
+}__attribute__((aligned(64))) MCSNode;
+
+// the layout MCSNode had before padding, kept for test_false_sharing
+typedef struct PackedMCSNode {
+	volatile int flag;
+	struct PackedMCSNode * volatile next;
+
+	PackedMCSNode () {
+		flag = 0;
+		next = NULL;
+	}
+} PackedMCSNode;
+
+
+typedef struct CLHNode {
+	volatile int locked;
+	// links the node into a thread's free list while it is not queued
+	CLHNode *next;
+
+	CLHNode () {
+		locked = 0;
 		next = NULL;
 	}
-} MCSNode;
+} CLHNode;
+
+
+#ifdef LOCK_STATS
+typedef struct LockStats {
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long spins;
+	unsigned long latency[STAT_BUCKETS];
+
+	LockStats () {
+		acquisitions = 0;
+		contended = 0;
+		spins = 0;
+		for (int i = 0;i < STAT_BUCKETS;i++) {
+			latency[i] = 0;
+		}
+	}
+}__attribute__((aligned(64))) LockStats;
+#endif
+
+
+// node carries an insert in and a freed node back out; a removed value
+// is moved straight into out by whoever serves the record
+template <typename T>
+struct FCRecord {
+	volatile int op;
+	Node<T> * volatile node;
+	T *out;
+
+	FCRecord () {
+		op = FC_NONE;
+		node = NULL;
+		out = NULL;
+	}
+}__attribute__((aligned(64)));
+
+
+typedef struct CohortState {
+	int global_held;
+	int pass_count;
+
+	CohortState () {
+		global_held = 0;
+		pass_count = 0;
+	}
+}__attribute__((aligned(64))) CohortState;
+
+
+typedef struct TicketSlot {
+	volatile unsigned int grant;
+
+	TicketSlot () {
+		grant = 0;
+	}
+}__attribute__((aligned(64))) TicketSlot;
+
+
+/////////////////////////////////////////////////////
+/* global inline function */
+
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+inline static long futex_wait (volatile int *addr, int val, const struct timespec *timeout = NULL) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+inline static long futex_wake (volatile int *addr, int count) {
+	return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#ifdef LOCK_STATS
+inline static unsigned long read_tsc () {
+	#if defined(__x86_64) || defined(__i386)
+		return __builtin_ia32_rdtsc();
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec*1000000000UL + ts.tv_nsec;
+	#endif
+}
 
+	#define LOCK_STAT_BEGIN() unsigned long stat_start = read_tsc(); unsigned long stat_spins = 0
+	#define LOCK_STAT_SPIN() stat_spins++
+	#define LOCK_STAT_END() record_acquire(stat_start, stat_spins)
+#else
+	#define LOCK_STAT_BEGIN()
+	#define LOCK_STAT_SPIN()
+	#define LOCK_STAT_END()
+#endif
 
 /////////////////////////////////////////////////////
 /* global function */
 
-void backoff () {
-	static int limit = MIN_DELAY;
-	int delay = rand()%limit*100;
-	limit = min(MAX_DELAY, 2*limit);
-	usleep(delay);
+// bytes per slab slot: small nodes get a power of two share of a cache
+// line and bigger ones whole lines, so no node straddles two of them
+constexpr size_t slab_slot (size_t size, size_t slot = sizeof(void *)) {
+	return slot >= size ? slot : (slot >= CACHE_LINE ? (size+CACHE_LINE-1)/CACHE_LINE*CACHE_LINE : slab_slot(size, slot*2));
+}
+
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
+// map every cpu to its NUMA node, returns the number of nodes
+int read_numa_topology (vector<int> &cpu_node) {
+	int node_count = 1;
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir == NULL) {
+		return node_count;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int node;
+		if (strncmp(entry->d_name, "node", 4) != 0 || sscanf(entry->d_name+4, "%d", &node) != 1) {
+			continue;
+		}
+		char path[300];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		FILE *fp = fopen(path, "r");
+		if (fp == NULL) {
+			continue;
+		}
+		int first, last;
+		char sep;
+		while (fscanf(fp, "%d", &first) == 1) {
+			last = first;
+			sep = fgetc(fp);
+			if (sep == '-') {
+				if (fscanf(fp, "%d", &last) != 1) {
+					break;
+				}
+				sep = fgetc(fp);
+			}
+			for (int cpu = first;cpu <= last;cpu++) {
+				if (cpu >= (int)cpu_node.size()) {
+					cpu_node.resize(cpu+1, 0);
+				}
+				cpu_node[cpu] = node;
+			}
+			if (sep != ',') {
+				break;
+			}
+		}
+		fclose(fp);
+		node_count = max(node_count, node+1);
+	}
+	closedir(dir);
+	return node_count;
 }
 
 /////////////////////////////////////////////////////
 /* class definition */
 
+// per-thread slab allocator for one node type, shared by every container
+// of that type. A thread carves nodes out of its own chunk of SLAB_NODES
+// slots and keeps the nodes it frees on its own list, whoever allocated
+// them; once that list holds 2*SLAB_BATCH nodes, SLAB_BATCH of them go to
+// the shared depot in one go, and a thread whose chunk ran out takes a
+// whole batch back before it carves a new one. Chunks live as long as the
+// process, so a thread may still free nodes while it exits.
+template <class NodeType>
+class NodeSlab {
+	private:
+		// plain data, so it needs no constructor and no destructor
+		typedef struct Cache {
+			NodeType *free_nodes;
+			int count;
+			char *cursor;
+			char *end;
+		} Cache;
+
+		typedef struct Depot {
+			// heads of NULL terminated batches
+			vector<NodeType *> batches;
+			vector<char *> chunks;
+			volatile int lock;
+			Depot () {
+				lock = 0;
+			}
+		} Depot;
+
+		static thread_local Cache cache;
+
+		static Depot * depot () {
+			static Depot *shared = new Depot();
+			return shared;
+		}
+
+		static void lock (Depot *shared) {
+			while (__sync_lock_test_and_set(&shared->lock, 1)) {
+				cpu_relax();
+			}
+		}
+
+		static void unlock (Depot *shared) {
+			__sync_lock_release(&shared->lock);
+		}
+
+		// a free node links to the next one through its first word
+		static NodeType *& next_free (NodeType *node) {
+			return *(NodeType **)node;
+		}
+
+		// only once the chunk is used up, so carving stays lock free
+		static bool take_batch (Cache *local) {
+			if (local->cursor != local->end) {
+				return false;
+			}
+			Depot *shared = depot();
+			lock(shared);
+			if (shared->batches.empty()) {
+				unlock(shared);
+				return false;
+			}
+			local->free_nodes = shared->batches.back();
+			local->count = SLAB_BATCH;
+			shared->batches.pop_back();
+			unlock(shared);
+			return true;
+		}
+
+		static void * carve (Cache *local) {
+			if (local->cursor == local->end) {
+				Depot *shared = depot();
+				local->cursor = (char *)aligned_alloc(CACHE_LINE, SLAB_NODES*slab_slot(sizeof(NodeType)));
+				local->end = local->cursor + SLAB_NODES*slab_slot(sizeof(NodeType));
+				lock(shared);
+				shared->chunks.push_back(local->cursor);
+				unlock(shared);
+			}
+			void *node = local->cursor;
+			local->cursor += slab_slot(sizeof(NodeType));
+			return node;
+		}
+
+		static void spill (Cache *local) {
+			NodeType *first = local->free_nodes;
+			NodeType *last = first;
+			for (int i = 1;i < SLAB_BATCH;i++) {
+				last = next_free(last);
+			}
+			local->free_nodes = next_free(last);
+			next_free(last) = NULL;
+			local->count -= SLAB_BATCH;
+			Depot *shared = depot();
+			lock(shared);
+			shared->batches.push_back(first);
+			unlock(shared);
+		}
+	public:
+		template <typename... Args>
+		static NodeType * alloc (Args&&... args) {
+			Cache *local = &cache;
+			if (local->free_nodes == NULL && !take_batch(local)) {
+				return new (carve(local)) NodeType(std::forward<Args>(args)...);
+			}
+			NodeType *node = local->free_nodes;
+			local->free_nodes = next_free(node);
+			local->count--;
+			return new (node) NodeType(std::forward<Args>(args)...);
+		}
+
+		static void recycle (NodeType *node) {
+			node->~NodeType();
+			Cache *local = &cache;
+			next_free(node) = local->free_nodes;
+			local->free_nodes = node;
+			if (++local->count >= 2*SLAB_BATCH) {
+				spill(local);
+			}
+		}
+
+		static long chunks () {
+			Depot *shared = depot();
+			lock(shared);
+			long count = shared->chunks.size();
+			unlock(shared);
+			return count;
+		}
+};
+
+template <class NodeType>
+thread_local typename NodeSlab<NodeType>::Cache NodeSlab<NodeType>::cache;
+
+// MCS queue nodes come from a per-thread free list rather than an array
+// indexed by omp_get_thread_num(), so the MCS locks work from any thread
+class MCSNodePool {
+	public:
+		MCSNode *free_nodes;
+
+		MCSNodePool () {
+			free_nodes = NULL;
+		}
+
+		~MCSNodePool () {
+			while (free_nodes != NULL) {
+				MCSNode *node = free_nodes;
+				free_nodes = node->next;
+				delete node;
+			}
+		}
+
+		MCSNode * get () {
+			MCSNode *node = free_nodes;
+			if (node == NULL) {
+				return new MCSNode();
+			}
+			free_nodes = node->next;
+			return node;
+		}
+
+		void put (MCSNode *node) {
+			node->next = free_nodes;
+			free_nodes = node;
+		}
+};
+
+static thread_local MCSNodePool mcs_pool;
+
+// CLH nodes change hands on unlock, so each thread keeps whatever nodes
+// it inherited in a free list of its own. try_lock() may still read a
+// node it saw at the tail after the node moved on, so nodes are never
+// freed: an exiting thread leaves its list as spares for the next one.
+static CLHNode *clh_spares = NULL;
+static volatile int clh_spares_lock = 0;
+
+class CLHNodePool {
+	public:
+		CLHNode *free_nodes;
+
+		CLHNodePool () {
+			free_nodes = NULL;
+		}
+
+		~CLHNodePool () {
+			if (free_nodes == NULL) {
+				return ;
+			}
+			CLHNode *last = free_nodes;
+			while (last->next != NULL) {
+				last = last->next;
+			}
+			while (__sync_lock_test_and_set(&clh_spares_lock, 1)) {}
+			last->next = clh_spares;
+			clh_spares = free_nodes;
+			__sync_lock_release(&clh_spares_lock);
+		}
+
+		CLHNode * get () {
+			if (free_nodes == NULL && clh_spares != NULL) {
+				while (__sync_lock_test_and_set(&clh_spares_lock, 1)) {}
+				free_nodes = clh_spares;
+				clh_spares = NULL;
+				__sync_lock_release(&clh_spares_lock);
+			}
+			CLHNode *node = free_nodes;
+			if (node == NULL) {
+				return new CLHNode();
+			}
+			free_nodes = node->next;
+			return node;
+		}
+
+		void put (CLHNode *node) {
+			node->next = free_nodes;
+			free_nodes = node;
+		}
+};
+
+static thread_local CLHNodePool clh_pool;
+
+// a small id per thread, handed out on first use: the delegation server
+// and std::thread callers all see omp_get_thread_num() == 0
+static volatile int thread_slots = 0;
+static thread_local int thread_slot = __sync_fetch_and_add(&thread_slots, 1);
+
 class LockObject {
 	public:
+	#ifdef LOCK_STATS
+		// one padded slot per thread, so counting adds no sharing
+		LockStats *stats;
+
+		LockObject () {
+			stats = new LockStats[thread_number];
+		}
+
+		virtual ~LockObject () {
+			delete [] stats;
+		}
+
+		// threads beyond thread_number share slots, so count atomically
+		void record_acquire (unsigned long start, unsigned long spins) {
+			LockStats *mystats = &stats[thread_slot%thread_number];
+			unsigned long cycles = read_tsc() - start;
+			int bucket = (cycles == 0) ? 0 : 63 - __builtin_clzl(cycles);
+			__sync_fetch_and_add(&mystats->acquisitions, 1);
+			__sync_fetch_and_add(&mystats->contended, (spins != 0));
+			__sync_fetch_and_add(&mystats->spins, spins);
+			__sync_fetch_and_add(&mystats->latency[min(bucket, STAT_BUCKETS-1)], 1);
+		}
+
+		virtual void report (const char *name) {
+			LockStats total;
+			for (int i = 0;i < thread_number;i++) {
+				total.acquisitions += stats[i].acquisitions;
+				total.contended += stats[i].contended;
+				total.spins += stats[i].spins;
+				for (int j = 0;j < STAT_BUCKETS;j++) {
+					total.latency[j] += stats[i].latency[j];
+				}
+			}
+			cout << name << " acquisitions: " << total.acquisitions << " , contended: " << total.contended << " , spins: " << total.spins << endl;
+			cout << name << " acquire cycles:";
+			for (int j = 0;j < STAT_BUCKETS;j++) {
+				if (total.latency[j] == 0) {
+					continue;
+				}
+				if (j == STAT_BUCKETS-1) {
+					cout << " >=2^" << j << ":" << total.latency[j];
+				} else {
+					cout << " <2^" << j+1 << ":" << total.latency[j];
+				}
+			}
+			cout << endl;
+		}
+	#else
 		LockObject () {}
-		~LockObject () {}
+		virtual ~LockObject () {}
+		virtual void report (const char *) {}
+	#endif
 		virtual void lock () {}
 		virtual void unlock () {}
+		virtual bool try_lock () { return true; }
+
+		// locks without a way to leave a wait queue just poll try_lock()
+		virtual bool try_lock_for (double timeout) {
+			double deadline = omp_get_wtime() + timeout;
+			while (!try_lock()) {
+				if (omp_get_wtime() >= deadline) {
+					return false;
+				}
+				cpu_relax();
+			}
+			return true;
+		}
+
+		// exclusive locks simply treat readers as writers
+		virtual void lock_shared () { lock(); }
+		virtual void unlock_shared () { unlock(); }
 };
 
-class MutexLock : public LockObject {
+class MutexLock final : public LockObject {
 	public:
 		pthread_mutex_t mutex;
 		
@@ -83,16 +622,34 @@ class MutexLock : public LockObject {
 		}
 
 		void lock () {
-			pthread_mutex_lock(&mutex);
+			LOCK_STAT_BEGIN();
+			if (pthread_mutex_trylock(&mutex) != 0) {
+				LOCK_STAT_SPIN();
+				pthread_mutex_lock(&mutex);
+			}
+			LOCK_STAT_END();
 		}
 
 		void unlock () {
 			pthread_mutex_unlock(&mutex);
 		}
+
+		bool try_lock () {
+			return pthread_mutex_trylock(&mutex) == 0;
+		}
+
+		bool try_lock_for (double timeout) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			long nsec = ts.tv_nsec + (long)((timeout-(long)timeout)*1e9);
+			ts.tv_sec += (long)timeout + nsec/1000000000L;
+			ts.tv_nsec = nsec%1000000000L;
+			return pthread_mutex_timedlock(&mutex, &ts) == 0;
+		}
 };
 
 
-class TASLock : public LockObject {
+class TASLock final : public LockObject {
 	public:
 		int taslock;
 		
@@ -104,41 +661,63 @@ class TASLock : public LockObject {
 		}
 
 		void lock () {
-			while (__sync_lock_test_and_set(&taslock, 1)) {}
+			LOCK_STAT_BEGIN();
+			while (__sync_lock_test_and_set(&taslock, 1)) {
+				LOCK_STAT_SPIN();
+			}
+			LOCK_STAT_END();
 		}
 
 		void unlock () {
 			__sync_lock_release(&taslock);
 		}
+
+		bool try_lock () {
+			return !__sync_lock_test_and_set(&taslock, 1);
+		}
 };
 
 
-class TASLockWiBackoff : public LockObject {
+class TASLockWiBackoff final : public LockObject {
 	public:
+		int backoff;
 		int taslock;
 		
 		TASLockWiBackoff () {
+			backoff = backoff_method;
 			taslock = 0;
 		}
 
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
 		~TASLockWiBackoff () {
 		}
 
 		void lock () {
+			Backoff bo(backoff);
+			LOCK_STAT_BEGIN();
 			while (__sync_lock_test_and_set(&taslock, 1)) {
-				backoff();
+				LOCK_STAT_SPIN();
+				bo.wait();
 			}
+			LOCK_STAT_END();
 		}
 
 		void unlock () {
 			__sync_lock_release(&taslock);
 		}
+
+		bool try_lock () {
+			return !__sync_lock_test_and_set(&taslock, 1);
+		}
 };
 
 
-class TTASLock : public LockObject {
+class TTASLock final : public LockObject {
 	public:
-		int ttaslock;
+		volatile int ttaslock;
 		
 		TTASLock () {
 			ttaslock = 0;
@@ -148,60 +727,124 @@ class TTASLock : public LockObject {
 		}
 
 		void lock () {
+			LOCK_STAT_BEGIN();
 			while (__sync_lock_test_and_set(&ttaslock, 1)) {
-				while (ttaslock) ;
+				while (ttaslock) {
+					LOCK_STAT_SPIN();
+				}
 			}
+			LOCK_STAT_END();
 		}
 
 		void unlock () {
 			__sync_lock_release(&ttaslock);
 		}
+
+		bool try_lock () {
+			return ttaslock == 0 && !__sync_lock_test_and_set(&ttaslock, 1);
+		}
 };
 
 
-class TTASLockWiBackoff : public LockObject {
+class TTASLockWiBackoff final : public LockObject {
 	public:
-		int ttaslock;
+		int backoff;
+		volatile int ttaslock;
 		
 		TTASLockWiBackoff () {
+			backoff = backoff_method;
 			ttaslock = 0;
 		}
 
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
 		~TTASLockWiBackoff () {
 		}
 
 		void lock () {
+			Backoff bo(backoff);
+			LOCK_STAT_BEGIN();
 			while (__sync_lock_test_and_set(&ttaslock, 1)) {
-				while (ttaslock) ;
-				backoff();
+				while (ttaslock) {
+					LOCK_STAT_SPIN();
+				}
+				bo.wait();
 			}
+			LOCK_STAT_END();
 		}
 
 		void unlock () {
 			__sync_lock_release(&ttaslock);
 		}
+
+		bool try_lock () {
+			return ttaslock == 0 && !__sync_lock_test_and_set(&ttaslock, 1);
+		}
 };
 
 
-class MCSLock : public LockObject {
+class MCSLock final : public LockObject {
 	public:
-		int mcslock;
-		MCSNode *local_node;
 		MCSNode *mcs_tail;
+		// the owner's queue node, only touched by the owner
+		MCSNode *holder;
 		
 		MCSLock () {
-			local_node = new MCSNode[thread_number];
-			mcs_tail = NULL;	
+			mcs_tail = NULL;
+			holder = NULL;
 		}
 
 		~MCSLock () {
 		}
 
 		void lock () {
-			int thread_id = omp_get_thread_num();
-			MCSNode *mynode = &local_node[thread_id];
+			LOCK_STAT_BEGIN();
+			MCSNode *mynode = mcs_pool.get();
+			MCSNode *predecessor = NULL;
+			mynode->flag = MCS_WAITING;
+			mynode->next = NULL;
+			while (true) {
+				predecessor = mcs_tail;
+				if (__sync_bool_compare_and_swap(&mcs_tail, predecessor, mynode)) {
+					break;
+				}
+				LOCK_STAT_SPIN();
+			}
+			if (predecessor != NULL) {
+				predecessor->next = mynode;
+				while (mynode->flag == MCS_WAITING) {
+					LOCK_STAT_SPIN();
+				}
+			}
+			holder = mynode;
+			LOCK_STAT_END();
+		}
+
+		bool try_lock () {
+			if (mcs_tail != NULL) {
+				return false;
+			}
+			MCSNode *mynode = mcs_pool.get();
+			mynode->flag = MCS_WAITING;
+			mynode->next = NULL;
+			if (!__sync_bool_compare_and_swap(&mcs_tail, (MCSNode *)NULL, mynode)) {
+				mcs_pool.put(mynode);
+				return false;
+			}
+			holder = mynode;
+			return true;
+		}
+
+		// queue up as lock() does, but on timeout mark the node abandoned
+		// and leave it in the queue; the releaser that reaches it skips
+		// and frees it, so the thread continues with a fresh node
+		bool try_lock_for (double timeout) {
+			double deadline = omp_get_wtime() + timeout;
+			MCSNode *mynode = mcs_pool.get();
 			MCSNode *predecessor = NULL;
-			mynode->flag = 0;
+			mynode->flag = MCS_WAITING;
 			mynode->next = NULL;
 			while (true) {
 				predecessor = mcs_tail;
@@ -211,149 +854,927 @@ class MCSLock : public LockObject {
 			}
 			if (predecessor != NULL) {
 				predecessor->next = mynode;
-				while (!mynode->flag) {}
+				while (mynode->flag == MCS_WAITING) {
+					if (omp_get_wtime() >= deadline && __sync_bool_compare_and_swap(&mynode->flag, MCS_WAITING, MCS_ABANDONED)) {
+						return false;
+					}
+					cpu_relax();
+				}
 			}
+			holder = mynode;
+			return true;
 		}
 
 		void unlock () {
-			int thread_id = omp_get_thread_num();
-			MCSNode *mynode = &local_node[thread_id];
-			if (mcs_tail == mynode) {
-				if (__sync_bool_compare_and_swap(&mcs_tail, mynode, NULL)) {
+			MCSNode *mynode = holder;
+			MCSNode *cur = mynode;
+			while (true) {
+				if (cur->next == NULL) {
+					if (__sync_bool_compare_and_swap(&mcs_tail, cur, (MCSNode *)NULL)) {
+						break;
+					}
+					while (cur->next == NULL) {}
+				}
+				MCSNode *successor = cur->next;
+				if (cur != mynode) {
+					delete cur;
+				}
+				if (__sync_bool_compare_and_swap(&successor->flag, MCS_WAITING, MCS_GRANTED)) {
+					mcs_pool.put(mynode);
 					return ;
 				}
+				cur = successor;
 			}
-			while (mynode->next == NULL) {}
-			(mynode->next)->flag = 1;
+			if (cur != mynode) {
+				delete cur;
+			}
+			mcs_pool.put(mynode);
+		}
+
+		bool has_waiters () {
+			return mcs_tail != holder;
 		}
 };
 
 
-class MCSLockWiBackoff : public LockObject {
+class MCSLockWiBackoff final : public LockObject {
 	public:
-		int mcslock;
-		MCSNode *local_node;
+		int backoff;
 		MCSNode *mcs_tail;
+		// the owner's queue node, only touched by the owner
+		MCSNode *holder;
 		
 		MCSLockWiBackoff () {
-			local_node = new MCSNode[thread_number];
-			mcs_tail = NULL;	
+			backoff = backoff_method;
+			mcs_tail = NULL;
+			holder = NULL;
+		}
+
+		void set_backoff (int method) {
+			backoff = method;
 		}
 
 		~MCSLockWiBackoff () {
 		}
 
 		void lock () {
-			int thread_id = omp_get_thread_num();
-			MCSNode *mynode = &local_node[thread_id];
+			Backoff bo(backoff);
+			LOCK_STAT_BEGIN();
+			MCSNode *mynode = mcs_pool.get();
+			MCSNode *predecessor = NULL;
+			mynode->flag = MCS_WAITING;
+			mynode->next = NULL;
+			while (true) {
+				predecessor = mcs_tail;
+				if (__sync_bool_compare_and_swap(&mcs_tail, predecessor, mynode)) {
+					break;
+				}
+				LOCK_STAT_SPIN();
+				bo.wait();
+			}
+			if (predecessor != NULL) {
+				predecessor->next = mynode;
+				while (mynode->flag == MCS_WAITING) {
+					LOCK_STAT_SPIN();
+				}
+			}
+			holder = mynode;
+			LOCK_STAT_END();
+		}
+
+		bool try_lock () {
+			if (mcs_tail != NULL) {
+				return false;
+			}
+			MCSNode *mynode = mcs_pool.get();
+			mynode->flag = MCS_WAITING;
+			mynode->next = NULL;
+			if (!__sync_bool_compare_and_swap(&mcs_tail, (MCSNode *)NULL, mynode)) {
+				mcs_pool.put(mynode);
+				return false;
+			}
+			holder = mynode;
+			return true;
+		}
+
+		bool try_lock_for (double timeout) {
+			Backoff bo(backoff);
+			double deadline = omp_get_wtime() + timeout;
+			MCSNode *mynode = mcs_pool.get();
 			MCSNode *predecessor = NULL;
-			mynode->flag = 0;
+			mynode->flag = MCS_WAITING;
 			mynode->next = NULL;
 			while (true) {
 				predecessor = mcs_tail;
 				if (__sync_bool_compare_and_swap(&mcs_tail, predecessor, mynode)) {
 					break;
 				}
-				backoff();
+				bo.wait();
 			}
 			if (predecessor != NULL) {
 				predecessor->next = mynode;
-				while (!mynode->flag) { }
+				while (mynode->flag == MCS_WAITING) {
+					if (omp_get_wtime() >= deadline && __sync_bool_compare_and_swap(&mynode->flag, MCS_WAITING, MCS_ABANDONED)) {
+						return false;
+					}
+					cpu_relax();
+				}
 			}
+			holder = mynode;
+			return true;
 		}
 
 		void unlock () {
-			int thread_id = omp_get_thread_num();
-			MCSNode *mynode = &local_node[thread_id];
-			if (mcs_tail == mynode) {
-				if (__sync_bool_compare_and_swap(&mcs_tail, mynode, NULL)) {
+			Backoff bo(backoff);
+			MCSNode *mynode = holder;
+			MCSNode *cur = mynode;
+			while (true) {
+				if (cur->next == NULL) {
+					if (__sync_bool_compare_and_swap(&mcs_tail, cur, (MCSNode *)NULL)) {
+						break;
+					}
+					while (cur->next == NULL) {  }
+				}
+				MCSNode *successor = cur->next;
+				if (cur != mynode) {
+					delete cur;
+				}
+				if (__sync_bool_compare_and_swap(&successor->flag, MCS_WAITING, MCS_GRANTED)) {
+					mcs_pool.put(mynode);
+					bo.wait();
 					return ;
 				}
+				cur = successor;
 			}
-			while (mynode->next == NULL) {  }
-			(mynode->next)->flag = 1;
-			backoff();
+			if (cur != mynode) {
+				delete cur;
+			}
+			mcs_pool.put(mynode);
 		}
 };
 
 
-class QueueLockCmp {
-	private:
-		Node *head;
-		Node *tail;
-		
+// the tail word packs the node pointer with an enqueue count in the top
+// bits (user addresses fit in 48), so try_lock() can tell that the
+// released tail it read was not recycled and queued again before its CAS
+class CLHLock final : public LockObject {
 	public:
-		LockObject *read_lock; 
-		LockObject *write_lock; 
+		volatile unsigned long clh_tail;
+		// the owner's node and the released node it queued behind,
+		// only touched by the owner
+		CLHNode *holder;
+		CLHNode *holder_pred;
+
+		CLHLock () {
+			clh_tail = (unsigned long)new CLHNode();
+			holder = NULL;
+			holder_pred = NULL;
+		}
 
-		QueueLockCmp () {
-			head = new Node();
-			tail = head;
-			read_lock = NULL;
-			write_lock = NULL;
+		~CLHLock () {
+			delete tail_node(clh_tail);
 		}
 
-		~QueueLockCmp () {
-			delete head;
+		static CLHNode * tail_node (unsigned long word) {
+			return (CLHNode *)(word & ((1UL << CLH_TAG_SHIFT)-1));
 		}
 
-		void enqueue (int val) {
-			Node *new_node = new Node(val);
-			write_lock->lock();
-			tail->next = new_node;
-			tail = new_node;
-			write_lock->unlock();
+		static unsigned long next_tail (unsigned long word, CLHNode *node) {
+			return (unsigned long)node | (((word >> CLH_TAG_SHIFT)+1) << CLH_TAG_SHIFT);
 		}
 
-		Node * dequeue () {
-			read_lock->lock();
-			Node *front = head->next;
-			if (front != NULL) {
-				head->next = front->next;
-				if (front->next == NULL) {
-					tail = head;
+		void lock () {
+			LOCK_STAT_BEGIN();
+			CLHNode *mynode = clh_pool.get();
+			mynode->locked = 1;
+			unsigned long old_tail;
+			while (true) {
+				old_tail = clh_tail;
+				if (__sync_bool_compare_and_swap(&clh_tail, old_tail, next_tail(old_tail, mynode))) {
+					break;
 				}
+				LOCK_STAT_SPIN();
 			}
-			read_lock->unlock();
-			return front;
+			CLHNode *predecessor = tail_node(old_tail);
+			while (predecessor->locked) {
+				LOCK_STAT_SPIN();
+			}
+			holder = mynode;
+			holder_pred = predecessor;
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			CLHNode *mynode = holder;
+			CLHNode *predecessor = holder_pred;
+			__sync_lock_release(&mynode->locked);
+			// nobody waits on the predecessor's node any more, keep it
+			clh_pool.put(predecessor);
+		}
+
+		// a released tail node has no owner, so nothing locks it again
+		// until someone queues behind it; the CAS then fails on the count,
+		// and a successful CAS means we hold the lock without waiting
+		bool try_lock () {
+			unsigned long old_tail = clh_tail;
+			CLHNode *predecessor = tail_node(old_tail);
+			if (predecessor->locked) {
+				return false;
+			}
+			CLHNode *mynode = clh_pool.get();
+			mynode->locked = 1;
+			if (!__sync_bool_compare_and_swap(&clh_tail, old_tail, next_tail(old_tail, mynode))) {
+				mynode->locked = 0;
+				clh_pool.put(mynode);
+				return false;
+			}
+			holder = mynode;
+			holder_pred = predecessor;
+			return true;
 		}
 };
 
 
-/////////////////////////////////////////////////////
-/* main */
+class TicketLock final : public LockObject {
+	public:
+		volatile unsigned int next_ticket;
+		volatile unsigned int now_serving;
 
-void test_time (LockObject *read_method, LockObject *write_method) {
-	double tstart = 0.0, ttaken = 0.0;
-	QueueLockCmp q_lock_cmp;
-	q_lock_cmp.read_lock = read_method;
-	q_lock_cmp.write_lock = write_method;
-	tstart = omp_get_wtime();
-	# pragma omp parallel for 
-	for (int i = 1;i <= N;i++) {
-		q_lock_cmp.enqueue(i);
-	}
-	ttaken = omp_get_wtime() - tstart;
-	cout << "push time: " << ttaken << endl;
-	
-	usleep(1000);
+		TicketLock () {
+			next_ticket = 0;
+			now_serving = 0;
+		}
 
-	tstart = 0.0;
-	ttaken = 0.0;
-	tstart = omp_get_wtime();
-	# pragma omp parallel for 
+		~TicketLock () {
+		}
+
+		void lock () {
+			LOCK_STAT_BEGIN();
+			unsigned int my_ticket = __sync_fetch_and_add(&next_ticket, 1);
+			while (true) {
+				unsigned int distance = my_ticket - now_serving;
+				if (distance == 0) {
+					break;
+				}
+				// wait roughly as long as the holders ahead of us will take
+				for (unsigned int i = 0;i < distance*TICKET_DELAY;i++) {
+					LOCK_STAT_SPIN();
+					cpu_relax();
+				}
+			}
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			__atomic_store_n(&now_serving, now_serving+1, __ATOMIC_RELEASE);
+		}
+
+		bool try_lock () {
+			unsigned int ticket = now_serving;
+			return next_ticket == ticket && __sync_bool_compare_and_swap(&next_ticket, ticket, ticket+1);
+		}
+};
+
+
+class PartitionedTicketLock final : public LockObject {
+	public:
+		volatile unsigned int request __attribute__((aligned(64)));
+		unsigned int owner_ticket __attribute__((aligned(64)));
+		TicketSlot slots[TICKET_SLOTS];
+
+		PartitionedTicketLock () {
+			request = 0;
+			owner_ticket = 0;
+		}
+
+		~PartitionedTicketLock () {
+		}
+
+		void lock () {
+			LOCK_STAT_BEGIN();
+			unsigned int my_ticket = __sync_fetch_and_add(&request, 1);
+			TicketSlot *slot = &slots[my_ticket%TICKET_SLOTS];
+			while (slot->grant != my_ticket) {
+				LOCK_STAT_SPIN();
+				cpu_relax();
+			}
+			owner_ticket = my_ticket;
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			unsigned int next = owner_ticket+1;
+			__atomic_store_n(&(slots[next%TICKET_SLOTS].grant), next, __ATOMIC_RELEASE);
+		}
+
+		bool try_lock () {
+			unsigned int ticket = request;
+			if (slots[ticket%TICKET_SLOTS].grant != ticket || !__sync_bool_compare_and_swap(&request, ticket, ticket+1)) {
+				return false;
+			}
+			owner_ticket = ticket;
+			return true;
+		}
+};
+
+
+// NUMA cohort lock: threads on one node queue on a local MCSLock and
+// the node holds the global TTASLock across up to pass_limit local
+// handoffs. COHORT_NODES=n fakes n nodes by thread id for testing.
+class CohortLock final : public LockObject {
+	public:
+		TTASLock *global_lock;
+		MCSLock **local_lock;
+		CohortState *state;
+		vector<int> cpu_node;
+		int node_count;
+		int virtual_nodes;
+		int pass_limit;
+		int owner_node;
+
+		CohortLock () {
+			const char *env = getenv("COHORT_NODES");
+			virtual_nodes = (env != NULL) ? atoi(env) : 0;
+			if (virtual_nodes > 0) {
+				node_count = virtual_nodes;
+			} else {
+				node_count = read_numa_topology(cpu_node);
+			}
+			env = getenv("COHORT_PASS_LIMIT");
+			pass_limit = (env != NULL) ? atoi(env) : COHORT_PASS_LIMIT;
+
+			global_lock = new TTASLock();
+			local_lock = new MCSLock*[node_count];
+			for (int i = 0;i < node_count;i++) {
+				local_lock[i] = new MCSLock();
+			}
+			state = new CohortState[node_count];
+			owner_node = 0;
+		}
+
+		~CohortLock () {
+			for (int i = 0;i < node_count;i++) {
+				delete local_lock[i];
+			}
+			delete [] local_lock;
+			delete [] state;
+			delete global_lock;
+		}
+
+	#ifdef LOCK_STATS
+		void report (const char *name) {
+			LockObject::report(name);
+			global_lock->report("  global");
+			for (int i = 0;i < node_count;i++) {
+				local_lock[i]->report("  local");
+			}
+		}
+	#endif
+
+		int current_node () {
+			if (virtual_nodes > 0) {
+				return thread_slot%virtual_nodes;
+			}
+			int cpu = sched_getcpu();
+			if (cpu < 0 || cpu >= (int)cpu_node.size()) {
+				return 0;
+			}
+			return cpu_node[cpu];
+		}
+
+		void lock () {
+			LOCK_STAT_BEGIN();
+			int node = current_node();
+			local_lock[node]->lock();
+			if (!state[node].global_held) {
+				global_lock->lock();
+				state[node].global_held = 1;
+				state[node].pass_count = 0;
+			}
+			owner_node = node;
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			int node = owner_node;
+			if (state[node].pass_count < pass_limit && local_lock[node]->has_waiters()) {
+				state[node].pass_count++;
+			} else {
+				state[node].global_held = 0;
+				global_lock->unlock();
+			}
+			local_lock[node]->unlock();
+		}
+
+		bool try_lock () {
+			int node = current_node();
+			if (!local_lock[node]->try_lock()) {
+				return false;
+			}
+			if (!state[node].global_held) {
+				if (!global_lock->try_lock()) {
+					local_lock[node]->unlock();
+					return false;
+				}
+				state[node].global_held = 1;
+				state[node].pass_count = 0;
+			}
+			owner_node = node;
+			return true;
+		}
+};
+
+
+// spin for a self-tuned number of rounds, then sleep in the kernel.
+// state: 0 free, 1 locked, 2 locked and someone may be parked
+class AdaptiveLock final : public LockObject {
+	public:
+		volatile int state;
+		int spin_avg;
+
+		AdaptiveLock () {
+			state = 0;
+			spin_avg = 0;
+		}
+
+		~AdaptiveLock () {
+		}
+
+		void lock () {
+			LOCK_STAT_BEGIN();
+			if (__sync_bool_compare_and_swap(&state, 0, 1)) {
+				LOCK_STAT_END();
+				return ;
+			}
+			int max_spin = min(ADAPTIVE_MAX_SPIN, 2*spin_avg+10);
+			int spins = 0;
+			bool acquired = false;
+			while (!acquired && spins < max_spin) {
+				spins++;
+				LOCK_STAT_SPIN();
+				cpu_relax();
+				acquired = (state == 0 && __sync_bool_compare_and_swap(&state, 0, 1));
+			}
+			if (!acquired) {
+				while (__sync_lock_test_and_set(&state, 2) != 0) {
+					LOCK_STAT_SPIN();
+					futex_wait(&state, 2);
+				}
+			}
+			// we own the lock here, so the update cannot race
+			spin_avg += (spins-spin_avg)/8;
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			if (__sync_fetch_and_sub(&state, 1) != 1) {
+				state = 0;
+				futex_wake(&state, 1);
+			}
+		}
+
+		bool try_lock () {
+			return state == 0 && __sync_bool_compare_and_swap(&state, 0, 1);
+		}
+
+		bool try_lock_for (double timeout) {
+			double deadline = omp_get_wtime() + timeout;
+			if (__sync_bool_compare_and_swap(&state, 0, 1)) {
+				return true;
+			}
+			int max_spin = min(ADAPTIVE_MAX_SPIN, 2*spin_avg+10);
+			for (int spins = 0;spins < max_spin;spins++) {
+				cpu_relax();
+				if (state == 0 && __sync_bool_compare_and_swap(&state, 0, 1)) {
+					return true;
+				}
+			}
+			// giving up with state left at 2 only costs the holder a
+			// spurious wake-up
+			while (__sync_lock_test_and_set(&state, 2) != 0) {
+				double remaining = deadline - omp_get_wtime();
+				if (remaining <= 0) {
+					return false;
+				}
+				struct timespec ts;
+				ts.tv_sec = (time_t)remaining;
+				ts.tv_nsec = (long)((remaining-ts.tv_sec)*1e9);
+				futex_wait(&state, 2, &ts);
+			}
+			return true;
+		}
+};
+
+
+// phase-fair ticket reader-writer lock (Brandenburg and Anderson):
+// readers and writers alternate phases, so neither side can starve.
+// rin/rout count readers in steps of PF_RINC, the low bits of rin
+// carry the present writer and its phase id.
+class PhaseFairLock final : public LockObject {
+	public:
+		volatile unsigned int rin;
+		volatile unsigned int rout;
+		volatile unsigned int win;
+		volatile unsigned int wout;
+
+		PhaseFairLock () {
+			rin = 0;
+			rout = 0;
+			win = 0;
+			wout = 0;
+		}
+
+		~PhaseFairLock () {
+		}
+
+		void lock_shared () {
+			LOCK_STAT_BEGIN();
+			unsigned int w = __sync_fetch_and_add(&rin, PF_RINC) & PF_WBITS;
+			if (w != 0) {
+				while (w == (rin & PF_WBITS)) {
+					LOCK_STAT_SPIN();
+					cpu_relax();
+				}
+			}
+			LOCK_STAT_END();
+		}
+
+		void unlock_shared () {
+			__sync_fetch_and_add(&rout, PF_RINC);
+		}
+
+		void lock () {
+			LOCK_STAT_BEGIN();
+			unsigned int ticket = __sync_fetch_and_add(&win, 1);
+			while (ticket != wout) {
+				LOCK_STAT_SPIN();
+				cpu_relax();
+			}
+			unsigned int w = PF_PRES | (ticket & PF_PHID);
+			unsigned int rticket = __sync_fetch_and_add(&rin, w);
+			while (rticket != rout) {
+				LOCK_STAT_SPIN();
+				cpu_relax();
+			}
+			LOCK_STAT_END();
+		}
+
+		void unlock () {
+			__sync_fetch_and_and(&rin, ~PF_WBITS);
+			__atomic_store_n(&wout, wout+1, __ATOMIC_RELEASE);
+		}
+
+		// fails if another writer holds or waits for the lock; readers
+		// already inside are waited out, as they cannot block us for long
+		bool try_lock () {
+			unsigned int ticket = wout;
+			if (win != ticket || !__sync_bool_compare_and_swap(&win, ticket, ticket+1)) {
+				return false;
+			}
+			unsigned int w = PF_PRES | (ticket & PF_PHID);
+			unsigned int rticket = __sync_fetch_and_add(&rin, w);
+			while (rticket != rout) {
+				cpu_relax();
+			}
+			return true;
+		}
+};
+
+
+template <class Lock = LockObject, typename T = int>
+class QueueLockCmp {
+	private:
+		Node<T> *head;
+		Node<T> *tail;
+		volatile long enqueue_count;
+		volatile long dequeue_count;
+		FCRecord<T> *fc_records;
+		volatile int fc_lock;
+		volatile int server_running;
+		thread *server;
+
+		void append (Node<T> *new_node) {
+			tail->next = new_node;
+			tail = new_node;
+			enqueue_count++;
+		}
+
+		// two-lock queue: the first node becomes the new dummy once its
+		// value is moved out, so dequeuers never touch tail. The old dummy
+		// is handed back for the caller to free outside the lock.
+		Node<T> * remove_front (T *out) {
+			Node<T> *front = head->next;
+			if (front == NULL) {
+				return NULL;
+			}
+			*out = std::move(front->value);
+			Node<T> *old_head = head;
+			head = front;
+			dequeue_count++;
+			return old_head;
+		}
+
+		// serve every posted request under a single hold of both locks
+		void serve_records () {
+			read_lock->lock();
+			write_lock->lock();
+			for (int pass = 0;pass < FC_PASSES;pass++) {
+				int applied = 0;
+				for (int i = 0;i < thread_number;i++) {
+					FCRecord<T> *r = &fc_records[i];
+					if (r->op == FC_INSERT) {
+						append(r->node);
+					} else if (r->op == FC_REMOVE) {
+						r->node = remove_front(r->out);
+					} else {
+						continue;
+					}
+					applied++;
+					__atomic_store_n(&r->op, FC_NONE, __ATOMIC_RELEASE);
+				}
+				if (applied == 0) {
+					break;
+				}
+			}
+			write_lock->unlock();
+			read_lock->unlock();
+		}
+
+		// flat combining: post the request, then either wait for the
+		// current combiner to serve it or become the combiner yourself;
+		// with a delegation server running, clients only ever wait
+		Node<T> * combine (int op, Node<T> *node, T *out) {
+			FCRecord<T> *rec = &fc_records[omp_get_thread_num()];
+			rec->node = node;
+			rec->out = out;
+			__atomic_store_n(&rec->op, op, __ATOMIC_RELEASE);
+			for (int spins = 1;rec->op != FC_NONE;spins++) {
+				// the server may share a core with us, so yield now and then
+				if (server != NULL && spins%DELEGATE_YIELD == 0) {
+					sched_yield();
+				}
+				if (server != NULL || fc_lock != 0 || __sync_lock_test_and_set(&fc_lock, 1)) {
+					cpu_relax();
+					continue;
+				}
+				serve_records();
+				__sync_lock_release(&fc_lock);
+			}
+			return rec->node;
+		}
+
+		// delegation (remote core locking): the server thread runs every
+		// critical section, so the container stays in its cache
+		void serve () {
+			int cpu = omp_get_num_procs()-1;
+			if (cpu > 0) {
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(cpu, &cpus);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+			}
+			int idle = 0;
+			while (server_running) {
+				idle++;
+				for (int i = 0;i < thread_number;i++) {
+					if (fc_records[i].op != FC_NONE) {
+						serve_records();
+						idle = 0;
+						break;
+					}
+				}
+				if (idle >= DELEGATE_YIELD) {
+					sched_yield();
+					idle = 0;
+				}
+				cpu_relax();
+			}
+		}
+		
+	public:
+		Lock *read_lock; 
+		Lock *write_lock; 
+
+		QueueLockCmp () {
+			head = NodeSlab<Node<T> >::alloc();
+			tail = head;
+			enqueue_count = 0;
+			dequeue_count = 0;
+			fc_records = NULL;
+			fc_lock = 0;
+			server_running = 0;
+			server = NULL;
+			read_lock = NULL;
+			write_lock = NULL;
+		}
+
+		~QueueLockCmp () {
+			// the server may still be serving records, stop it first
+			if (server != NULL) {
+				server_running = 0;
+				server->join();
+				delete server;
+			}
+			while (head != NULL) {
+				Node<T> *next = head->next;
+				NodeSlab<Node<T> >::recycle(head);
+				head = next;
+			}
+			delete [] fc_records;
+		}
+
+		void enable_combining () {
+			fc_records = new FCRecord<T>[thread_number];
+		}
+
+		// the per-client mailboxes are the combining records
+		void enable_delegation () {
+			enable_combining();
+			server_running = 1;
+			server = new thread(&QueueLockCmp<Lock, T>::serve, this);
+		}
+
+		template <typename... Args>
+		void emplace (Args&&... args) {
+			Node<T> *new_node = NodeSlab<Node<T> >::alloc(std::forward<Args>(args)...);
+			if (fc_records != NULL) {
+				combine(FC_INSERT, new_node, NULL);
+				return ;
+			}
+			write_lock->lock();
+			append(new_node);
+			write_lock->unlock();
+		}
+
+		void enqueue (T val) {
+			emplace(std::move(val));
+		}
+
+		bool dequeue (T *out) {
+			Node<T> *old_head;
+			if (fc_records != NULL) {
+				old_head = combine(FC_REMOVE, NULL, out);
+			} else {
+				read_lock->lock();
+				old_head = remove_front(out);
+				read_lock->unlock();
+			}
+			if (old_head == NULL) {
+				return false;
+			}
+			NodeSlab<Node<T> >::recycle(old_head);
+			return true;
+		}
+
+		// the batch is linked outside the lock and spliced in under one hold;
+		// the values are moved out of vals
+		void enqueue_bulk (T *vals, int count) {
+			if (count <= 0) {
+				return ;
+			}
+			if (fc_records != NULL) {
+				for (int i = 0;i < count;i++) {
+					enqueue(std::move(vals[i]));
+				}
+				return ;
+			}
+			Node<T> *first = NodeSlab<Node<T> >::alloc(std::move(vals[0]));
+			Node<T> *last = first;
+			for (int i = 1;i < count;i++) {
+				last->next = NodeSlab<Node<T> >::alloc(std::move(vals[i]));
+				last = last->next;
+			}
+			write_lock->lock();
+			tail->next = first;
+			tail = last;
+			enqueue_count += count;
+			write_lock->unlock();
+		}
+
+		// up to k values under one hold of read_lock, returns how many. The
+		// old dummies stay chained, so they are freed after the unlock.
+		int dequeue_bulk (T *vals, int k) {
+			int count = 0;
+			if (fc_records != NULL) {
+				while (count < k && dequeue(&vals[count])) {
+					count++;
+				}
+				return count;
+			}
+			read_lock->lock();
+			Node<T> *old_head = head;
+			while (count < k && remove_front(&vals[count]) != NULL) {
+				count++;
+			}
+			read_lock->unlock();
+			for (int i = 0;i < count;i++) {
+				Node<T> *next = old_head->next;
+				NodeSlab<Node<T> >::recycle(old_head);
+				old_head = next;
+			}
+			return count;
+		}
+
+		// false means the lock stayed busy (for timeout seconds, if given)
+		// and nothing happened
+		bool try_enqueue (T val, double timeout = 0) {
+			if (fc_records != NULL) {
+				enqueue(std::move(val));
+				return true;
+			}
+			if (!(timeout > 0 ? write_lock->try_lock_for(timeout) : write_lock->try_lock())) {
+				return false;
+			}
+			append(NodeSlab<Node<T> >::alloc(std::move(val)));
+			write_lock->unlock();
+			return true;
+		}
+
+		// found tells an empty queue apart from a busy lock
+		bool try_dequeue (T *out, bool *found, double timeout = 0) {
+			if (fc_records != NULL) {
+				*found = dequeue(out);
+				return true;
+			}
+			if (!(timeout > 0 ? read_lock->try_lock_for(timeout) : read_lock->try_lock())) {
+				return false;
+			}
+			Node<T> *old_head = remove_front(out);
+			read_lock->unlock();
+			*found = (old_head != NULL);
+			if (old_head != NULL) {
+				NodeSlab<Node<T> >::recycle(old_head);
+			}
+			return true;
+		}
+
+		bool peek (T *val) {
+			read_lock->lock_shared();
+			Node<T> *front = head->next;
+			if (front != NULL) {
+				*val = front->value;
+			}
+			read_lock->unlock_shared();
+			return front != NULL;
+		}
+
+		// enqueuers are not excluded, so this is only a snapshot
+		long approx_size () {
+			read_lock->lock_shared();
+			long size = enqueue_count - dequeue_count;
+			read_lock->unlock_shared();
+			return size;
+		}
+};
+
+
+/////////////////////////////////////////////////////
+/* main */
+
+template <class Lock>
+void test_time (Lock *read_method, Lock *write_method) {
+	double tstart = 0.0, ttaken = 0.0;
+	QueueLockCmp<Lock> q_lock_cmp;
+	q_lock_cmp.read_lock = read_method;
+	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
+	tstart = omp_get_wtime();
+	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		q_lock_cmp.dequeue();
+		q_lock_cmp.enqueue(i);
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "push time: " << ttaken << endl;
+	
+	usleep(1000);
+
+	tstart = 0.0;
+	ttaken = 0.0;
+	tstart = omp_get_wtime();
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		q_lock_cmp.dequeue(&val);
 	}
 	ttaken = omp_get_wtime() - tstart;
 	cout << "dequeue time: " << ttaken << endl;
 
 }
 
-void test_enqueue_correct (LockObject *read_method, LockObject *write_method) {
-	QueueLockCmp q_lock_cmp;
+template <class Lock>
+void test_enqueue_correct (Lock *read_method, Lock *write_method) {
+	QueueLockCmp<Lock> q_lock_cmp;
 	q_lock_cmp.read_lock = read_method;
 	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
 
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
@@ -362,18 +1783,18 @@ void test_enqueue_correct (LockObject *read_method, LockObject *write_method) {
 
 	int count = 0;
 	for (int i = 1;i <= N;i++) {
-		Node *pop_val = q_lock_cmp.dequeue();
-		if (pop_val == NULL) {
+		int pop_val;
+		if (!q_lock_cmp.dequeue(&pop_val)) {
 			break;
 		}
 		count++;
-		if (correct_check[pop_val->value] == 0) {
-			cout << "Unseen variable " << pop_val->value << endl;
+		if (correct_check[pop_val] == 0) {
+			cout << "Unseen variable " << pop_val << endl;
 			return ;
 		}
 		
-		correct_check[pop_val->value]--;
-		if (correct_check[pop_val->value] < 0) {
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
 			cout << "Multiple variable" << endl;
 			return ;
 		}
@@ -387,18 +1808,25 @@ void test_enqueue_correct (LockObject *read_method, LockObject *write_method) {
 	cout << "Enqueue Correct" << endl;
 }
 
-void test_dequeue_correct (LockObject *read_method, LockObject *write_method) {
-	QueueLockCmp q_lock_cmp;
+template <class Lock>
+void test_dequeue_correct (Lock *read_method, Lock *write_method) {
+	QueueLockCmp<Lock> q_lock_cmp;
 	q_lock_cmp.read_lock = read_method;
 	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
 	for (int i = 1;i <= N;i++) {
 		q_lock_cmp.enqueue(i);
 	}
 
 	# pragma omp parallel for 
 	for (int i = 1;i <= N;i++) {
-		Node *data = q_lock_cmp.dequeue();
-		correct_thread[omp_get_thread_num()].push_back(data->value);
+		int data;
+		q_lock_cmp.dequeue(&data);
+		correct_thread[omp_get_thread_num()].push_back(data);
 	}
 
 	int count = 0;
@@ -426,74 +1854,481 @@ void test_dequeue_correct (LockObject *read_method, LockObject *write_method) {
 }
 
 
-int main (int argc, char *argv[]) {
+template <class Lock>
+void test_rw_mix (Lock *read_method, Lock *write_method, int read_percent) {
+	double tstart = 0.0, ttaken = 0.0;
+	QueueLockCmp<Lock> q_lock_cmp;
+	q_lock_cmp.read_lock = read_method;
+	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
+	for (int i = 1;i <= 1000;i++) {
+		q_lock_cmp.enqueue(i);
+	}
 
-	if (argc < 4 || argc > 4) {
-		printf("error argument number\n");
-		return 0;
+	tstart = omp_get_wtime();
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		// cheap deterministic spread of reads and writes over the loop
+		if ((unsigned int)(i*2654435761u)%100 < (unsigned int)read_percent) {
+			if (i&1) {
+				q_lock_cmp.peek(&val);
+			} else {
+				q_lock_cmp.approx_size();
+			}
+		} else {
+			if (i&1) {
+				q_lock_cmp.enqueue(i);
+			} else {
+				int val;
+				q_lock_cmp.dequeue(&val);
+			}
+		}
 	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "read " << read_percent << "% mix time: " << ttaken << endl;
+}
 
+template <class Lock>
+void test_try (Lock *read_method, Lock *write_method) {
+	double tstart = 0.0, ttaken = 0.0;
+	QueueLockCmp<Lock> q_lock_cmp;
+	q_lock_cmp.read_lock = read_method;
+	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
+	long enqueue_fail = 0, dequeue_fail = 0;
+	tstart = omp_get_wtime();
+	// timed attempts on the way in, plain ones on the way out
+	# pragma omp parallel for reduction(+:enqueue_fail)
 	for (int i = 1;i <= N;i++) {
-		correct_check[i] = 1;
+		while (!q_lock_cmp.try_enqueue(i, TRY_TIMEOUT)) {
+			enqueue_fail++;
+		}
 	}
+	# pragma omp parallel for reduction(+:dequeue_fail)
+	for (int i = 1;i <= N;i++) {
+		int data;
+		bool found;
+		while (!q_lock_cmp.try_dequeue(&data, &found)) {
+			dequeue_fail++;
+		}
+		if (found) {
+			correct_thread[omp_get_thread_num()].push_back(data);
+		}
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "try time: " << ttaken << " , enqueue fails: " << enqueue_fail << " , dequeue fails: " << dequeue_fail << endl;
 
-	thread_number = atoi(argv[1]);
-	correct_thread = new vector<int>[thread_number];
-	lock_method = atoi(argv[2]);
-	int test_method = atoi(argv[3]);
+	int count = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			count++;
+			int dequeue_val = correct_thread[i][j];
+			if (correct_check[dequeue_val] == 0) {
+				cout << "Unseen variable" << endl;
+				return ;
+			}
+			correct_check[dequeue_val]--;
+			if (correct_check[dequeue_val] < 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+
+	if (count != N) {
+		cout << "Dequeue number: " << count << " , sample number: " << N << endl;
+		return ;
+	}
+	cout << "Try Correct" << endl;
+}
+
+// enqueue_bulk/dequeue_bulk over a range of batch sizes
+template <class Lock>
+void test_bulk (Lock *read_method, Lock *write_method) {
+	int batch_sizes[] = {1, 4, 16, 64, 256};
+	for (int b = 0;b < 5;b++) {
+		int batch = batch_sizes[b];
+		int batches = (N+batch-1)/batch;
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		QueueLockCmp<Lock> q_lock_cmp;
+		q_lock_cmp.read_lock = read_method;
+		q_lock_cmp.write_lock = write_method;
+		if (exec_method == 2) {
+			q_lock_cmp.enable_combining();
+		} else if (exec_method == 3) {
+			q_lock_cmp.enable_delegation();
+		}
+		for (int i = 0;i < thread_number;i++) {
+			correct_thread[i].clear();
+		}
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int j = 0;j < batches;j++) {
+			int vals[256];
+			int count = min(batch, N-j*batch);
+			for (int i = 0;i < count;i++) {
+				vals[i] = j*batch+i+1;
+			}
+			q_lock_cmp.enqueue_bulk(vals, count);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel 
+		{
+			int vals[256];
+			int count;
+			while ((count = q_lock_cmp.dequeue_bulk(vals, batch)) > 0) {
+				for (int i = 0;i < count;i++) {
+					correct_thread[omp_get_thread_num()].push_back(vals[i]);
+				}
+			}
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "batch " << batch << " , enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+
+		vector<int> seen(N+1, 0);
+		int total = 0;
+		for (int i = 0;i < thread_number;i++) {
+			for (size_t j = 0;j < correct_thread[i].size();j++) {
+				total++;
+				if (seen[correct_thread[i][j]]++ != 0) {
+					cout << "Multiple variable" << endl;
+					return ;
+				}
+			}
+		}
+		if (total != N) {
+			cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+			return ;
+		}
+	}
+	cout << "Bulk Correct" << endl;
+}
+
+// the same code over a cache-line sized message and over a move-only
+// unique_ptr, which has to be moved in and out of the nodes
+template <class Lock>
+void test_generic (Lock *read_method, Lock *write_method) {
+	double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+	{
+		QueueLockCmp<Lock, Message> q_lock_cmp;
+		q_lock_cmp.read_lock = read_method;
+		q_lock_cmp.write_lock = write_method;
+		if (exec_method == 2) {
+			q_lock_cmp.enable_combining();
+		} else if (exec_method == 3) {
+			q_lock_cmp.enable_delegation();
+		}
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg{};
+			msg.id = i;
+			q_lock_cmp.enqueue(msg);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			Message msg;
+			q_lock_cmp.dequeue(&msg);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << "64-byte message, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+
+	QueueLockCmp<Lock, unique_ptr<int> > q_lock_cmp;
+	q_lock_cmp.read_lock = read_method;
+	q_lock_cmp.write_lock = write_method;
+	if (exec_method == 2) {
+		q_lock_cmp.enable_combining();
+	} else if (exec_method == 3) {
+		q_lock_cmp.enable_delegation();
+	}
+	for (int i = 0;i < thread_number;i++) {
+		correct_thread[i].clear();
+	}
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_lock_cmp.emplace(new int(i));
+	}
+	# pragma omp parallel 
+	{
+		unique_ptr<int> data;
+		while (q_lock_cmp.dequeue(&data)) {
+			correct_thread[omp_get_thread_num()].push_back(*data);
+		}
+	}
+	vector<int> seen(N+1, 0);
+	int total = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			total++;
+			if (seen[correct_thread[i][j]]++ != 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	if (total != N) {
+		cout << "Dequeue number: " << total << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Generic Correct" << endl;
+}
+
+template <class Lock>
+void test_oversubscribed_lock (const char *name) {
+	QueueLockCmp<Lock> q_lock_cmp;
+	Lock read_lock, write_lock;
+	q_lock_cmp.read_lock = &read_lock;
+	q_lock_cmp.write_lock = &write_lock;
+	long ops = 0;
+	double tstart = omp_get_wtime();
+	# pragma omp parallel reduction(+:ops)
+	{
+		// a fixed time budget, since FIFO spin locks may only manage
+		// one handoff per scheduler tick once threads outnumber cores
+		for (int i = 1;omp_get_wtime()-tstart < OVERSUB_TIME;i++) {
+			q_lock_cmp.enqueue(i);
+			int val;
+			q_lock_cmp.dequeue(&val);
+			ops += 2;
+		}
+	}
+	double ttaken = omp_get_wtime() - tstart;
+	cout << name << " ops/sec: " << ops/ttaken << endl;
+	q_lock_cmp.read_lock->report("read_lock");
+	q_lock_cmp.write_lock->report("write_lock");
+}
+
+void test_oversubscribed () {
+	int cores = omp_get_num_procs();
+	if (thread_number <= cores) {
+		thread_number = 2*cores;
+	}
 	omp_set_num_threads(thread_number);
+	cout << "threads: " << thread_number << " , cores: " << cores << endl;
+	test_oversubscribed_lock<MutexLock>("MutexLock");
+	test_oversubscribed_lock<TTASLock>("TTASLock");
+	test_oversubscribed_lock<MCSLock>("MCSLock");
+	test_oversubscribed_lock<AdaptiveLock>("AdaptiveLock");
+}
+
+// each thread resets and polls its own queue node, as an MCS waiter
+// does; packed nodes share cache lines, padded ones do not
+template <class QNode>
+double test_node_layout (QNode *nodes, int threads) {
+	vector<thread> workers;
+	double tstart = omp_get_wtime();
+	for (int t = 0;t < threads;t++) {
+		workers.push_back(thread([nodes, t] () {
+			QNode *mynode = &nodes[t];
+			for (int i = 1;i <= N;i++) {
+				mynode->next = NULL;
+				mynode->flag = i;
+				while (mynode->flag != i) {}
+			}
+		}));
+	}
+	for (int t = 0;t < threads;t++) {
+		workers[t].join();
+	}
+	return omp_get_wtime() - tstart;
+}
 
-	LockObject *read_method = NULL;
-	LockObject *write_method = NULL;
+template <class Lock>
+void test_std_thread_lock (const char *name, int threads) {
+	QueueLockCmp<Lock> q_lock_cmp;
+	Lock read_lock, write_lock;
+	q_lock_cmp.read_lock = &read_lock;
+	q_lock_cmp.write_lock = &write_lock;
+	vector<thread> workers;
+	double tstart = omp_get_wtime();
+	for (int t = 0;t < threads;t++) {
+		workers.push_back(thread([&q_lock_cmp, t, threads] () {
+			for (int i = t+1;i <= N;i += threads) {
+				q_lock_cmp.enqueue(i);
+			}
+		}));
+	}
+	for (int t = 0;t < threads;t++) {
+		workers[t].join();
+	}
+	double ttaken = omp_get_wtime() - tstart;
+	cout << name << " enqueue time from " << threads << " std::threads: " << ttaken << endl;
 
-	switch (lock_method) {
+	vector<int> seen(N+1, 0);
+	for (int i = 1;i <= N;i++) {
+		int data;
+		if (!q_lock_cmp.dequeue(&data) || data < 1 || data > N || seen[data]++ != 0) {
+			cout << name << " std::thread enqueue incorrect" << endl;
+			return ;
+		}
+	}
+	cout << name << " std::thread Correct" << endl;
+}
+
+void test_false_sharing () {
+	// one thread more than the OpenMP team, which the MCS locks used to size for
+	int threads = thread_number + 1;
+	PackedMCSNode *packed = new PackedMCSNode[threads];
+	MCSNode *padded = new MCSNode[threads];
+	cout << "packed nodes: " << test_node_layout(packed, threads) << " , padded nodes: " << test_node_layout(padded, threads) << endl;
+	delete [] packed;
+	delete [] padded;
+	test_std_thread_lock<MCSLock>("MCSLock", threads);
+	test_std_thread_lock<MCSLockWiBackoff>("MCSLockWiBackoff", threads);
+}
+
+// cost of one node allocation plus its free, new/delete against the
+// slab. Every thread allocates a block of nodes and frees every
+// thread_number-th one, so most frees cross threads the way dequeues do
+void test_alloc () {
+	Node<int> **nodes = new Node<int> *[N];
+	for (int slab = 0;slab <= 1;slab++) {
+		double tstart = omp_get_wtime();
+		for (int round = 0;round < ALLOC_ROUNDS;round++) {
+			# pragma omp parallel for schedule(static)
+			for (int i = 0;i < N;i++) {
+				nodes[i] = slab ? NodeSlab<Node<int> >::alloc(i) : new Node<int>(i);
+			}
+			# pragma omp parallel for schedule(static, 1)
+			for (int i = 0;i < N;i++) {
+				if (slab) {
+					NodeSlab<Node<int> >::recycle(nodes[i]);
+				} else {
+					delete nodes[i];
+				}
+			}
+		}
+		double ttaken = omp_get_wtime() - tstart;
+		cout << (slab ? "slab" : "new/delete") << " alloc+free: " << ttaken*1e9/((double)N*ALLOC_ROUNDS) << " ns per node" << endl;
+	}
+	cout << "slab chunks: " << NodeSlab<Node<int> >::chunks() << " of " << SLAB_NODES << " nodes" << endl;
+	delete [] nodes;
+}
+
+template <class Lock>
+int dispatch_test (int test_method, int read_percent, Lock *read_method, Lock *write_method) {
+	switch (test_method) {
 		case 1:
-			read_method = new MutexLock();
-			write_method = new MutexLock();
+			test_time(read_method, write_method);
 			break;
 		case 2:
-			read_method = new TASLock();
-			write_method = new TASLock();
+			test_enqueue_correct(read_method, write_method);
 			break;
 		case 3:
-			read_method = new TASLockWiBackoff();
-			write_method = new TASLockWiBackoff();
-			break;
-		case 4:
-			read_method = new TTASLock();
-			write_method = new TTASLock();
+			test_dequeue_correct(read_method, write_method);
 			break;
 		case 5:
-			read_method = new TTASLockWiBackoff();
-			write_method = new TTASLockWiBackoff();
+			test_rw_mix(read_method, write_method, read_percent);
 			break;
 		case 6:
-			read_method = new MCSLock();
-			write_method = new MCSLock();
+			test_try(read_method, write_method);
 			break;
-		case 7:
-			read_method = new MCSLockWiBackoff();
-			write_method = new MCSLockWiBackoff();
+		case 8:
+			test_bulk(read_method, write_method);
+			break;
+		case 9:
+			test_generic(read_method, write_method);
 			break;
 		default:
-			cout << "error lock method" << endl;
+			printf("error test method\n");
 			return 0;
 	}
+	read_method->report("read_lock");
+	write_method->report("write_lock");
+	return 0;
+}
 
-	switch (test_method) {
+template <class Lock>
+int run_test (int test_method, int read_percent) {
+	Lock *read_method = new Lock();
+	Lock *write_method = new Lock();
+	if (exec_method == 1) {
+		// call the lock through the LockObject vtable instead of inlining it
+		return dispatch_test<LockObject>(test_method, read_percent, read_method, write_method);
+	}
+	return dispatch_test<Lock>(test_method, read_percent, read_method, write_method);
+}
+
+
+int main (int argc, char *argv[]) {
+
+	if (argc < 4 || argc > 7) {
+		printf("error argument number\n");
+		return 0;
+	}
+
+	for (int i = 1;i <= N;i++) {
+		correct_check[i] = 1;
+	}
+
+	thread_number = atoi(argv[1]);
+	correct_thread = new vector<int>[thread_number];
+	lock_method = atoi(argv[2]);
+	int test_method = atoi(argv[3]);
+	exec_method = (argc > 4) ? atoi(argv[4]) : 0;
+	int read_percent = (argc > 5) ? atoi(argv[5]) : READ_PERCENT;
+	backoff_method = (argc > 6) ? atoi(argv[6]) : BACKOFF_EXP;
+	omp_set_num_threads(thread_number);
+
+	if (test_method == 4) {
+		test_oversubscribed();
+		return 0;
+	}
+
+	if (test_method == 7) {
+		test_false_sharing();
+		return 0;
+	}
+
+	if (test_method == 10) {
+		test_alloc();
+		return 0;
+	}
+
+	switch (lock_method) {
 		case 1:
-			test_time(read_method, write_method);
-			break;
+			return run_test<MutexLock>(test_method, read_percent);
 		case 2:
-			test_enqueue_correct(read_method, write_method);
-			break;
+			return run_test<TASLock>(test_method, read_percent);
 		case 3:
-			test_dequeue_correct(read_method, write_method);
-			break;
+			return run_test<TASLockWiBackoff>(test_method, read_percent);
+		case 4:
+			return run_test<TTASLock>(test_method, read_percent);
+		case 5:
+			return run_test<TTASLockWiBackoff>(test_method, read_percent);
+		case 6:
+			return run_test<MCSLock>(test_method, read_percent);
+		case 7:
+			return run_test<MCSLockWiBackoff>(test_method, read_percent);
+		case 8:
+			return run_test<CLHLock>(test_method, read_percent);
+		case 9:
+			return run_test<TicketLock>(test_method, read_percent);
+		case 10:
+			return run_test<PartitionedTicketLock>(test_method, read_percent);
+		case 11:
+			return run_test<CohortLock>(test_method, read_percent);
+		case 12:
+			return run_test<AdaptiveLock>(test_method, read_percent);
+		case 13:
+			return run_test<PhaseFairLock>(test_method, read_percent);
 		default:
-			printf("error test method\n");
+			cout << "error lock method" << endl;
 			return 0;
 	}
-
-	return 0;
 }
@@ -0,0 +1,346 @@
+#include <iostream>
+#include <cstdlib>
+#include <omp.h>
+#include <unistd.h>
+#include <time.h>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+#define N 1000000
+#define RING_SIZE (1<<20)
+#define MIN_DELAY 16
+#define MAX_DELAY 4096
+#define PROP_DELAY 32
+#define BACKOFF_NONE 0
+#define BACKOFF_EXP 1
+#define BACKOFF_PROP 2
+
+int thread_number;
+int backoff_method;
+map<int, int> correct_check;
+vector<int> *correct_thread;
+
+/////////////////////////////////////////////////////
+/* structure definition */
+
+typedef struct Cell {
+	volatile unsigned long sequence;
+	int value;
+
+	Cell () {
+		sequence = 0;
+		value = 0;
+	}
+} Cell;
+
+
+/////////////////////////////////////////////////////
+/* global inline function */
+
+inline static void cpu_relax () {
+	#if defined(__x86_64) || defined(__i386)
+		__asm__ __volatile__("pause" ::: "memory");
+	#else
+		__asm__ __volatile__("" ::: "memory");
+	#endif
+}
+
+/////////////////////////////////////////////////////
+/* global function */
+
+// per-thread xorshift state, so backing off takes no lock
+static __thread unsigned int backoff_seed = 0;
+
+// one Backoff lives on the stack of each operation, which keeps the
+// delay state private to the thread; delays are counted in PAUSEs
+typedef struct Backoff {
+	int method;
+	unsigned int limit;
+	unsigned int attempts;
+
+	Backoff (int kind) {
+		method = kind;
+		limit = MIN_DELAY;
+		attempts = 0;
+	}
+
+	// the retry loops re-read plain shared fields, so even BACKOFF_NONE
+	// has to stay a compiler barrier
+	void wait () {
+		__asm__ __volatile__("" ::: "memory");
+		unsigned int delay = 0;
+		if (method == BACKOFF_EXP) {
+			if (backoff_seed == 0) {
+				backoff_seed = (unsigned int)(unsigned long)&backoff_seed | 1;
+			}
+			backoff_seed ^= backoff_seed << 13;
+			backoff_seed ^= backoff_seed >> 17;
+			backoff_seed ^= backoff_seed << 5;
+			delay = backoff_seed % limit;
+			limit = min((unsigned int)MAX_DELAY, 2*limit);
+		} else if (method == BACKOFF_PROP) {
+			attempts++;
+			delay = min((unsigned int)MAX_DELAY, attempts*PROP_DELAY);
+		}
+		for (unsigned int i = 0;i < delay;i++) {
+			cpu_relax();
+		}
+	}
+} Backoff;
+
+/////////////////////////////////////////////////////
+/* class definition */
+
+// bounded MPMC queue (Vyukov): each cell carries a sequence number that
+// says whose turn it is, so producers and consumers only ever CAS their
+// own position counter and no node is allocated per operation.
+// cell i is free for the enqueue at position p when sequence == p, and
+// holds the value for the dequeue at p when sequence == p+1.
+class RingQueue {
+	private:
+		int backoff;
+		Cell *buffer;
+		unsigned long mask;
+		volatile unsigned long enqueue_pos __attribute__((aligned(64)));
+		volatile unsigned long dequeue_pos __attribute__((aligned(64)));
+	public:
+
+		// size has to be a power of two
+		RingQueue (unsigned long size) {
+			backoff = backoff_method;
+			buffer = new Cell[size];
+			mask = size-1;
+			for (unsigned long i = 0;i < size;i++) {
+				buffer[i].sequence = i;
+			}
+			enqueue_pos = 0;
+			dequeue_pos = 0;
+		}
+
+		~RingQueue () {
+			delete [] buffer;
+		}
+
+		void set_backoff (int method) {
+			backoff = method;
+		}
+
+		// false if the queue is full
+		bool enqueue (int val) {
+			Backoff bo(backoff);
+			Cell *cell;
+			unsigned long pos = enqueue_pos;
+			while (true) {
+				cell = &buffer[pos&mask];
+				unsigned long seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+				long diff = (long)(seq-pos);
+				if (diff == 0) {
+					if (__sync_bool_compare_and_swap(&enqueue_pos, pos, pos+1)) {
+						break;
+					}
+					bo.wait();
+				} else if (diff < 0) {
+					return false;
+				}
+				pos = enqueue_pos;
+			}
+			cell->value = val;
+			__atomic_store_n(&cell->sequence, pos+1, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		// false if the queue is empty
+		bool dequeue (int *val) {
+			Backoff bo(backoff);
+			Cell *cell;
+			unsigned long pos = dequeue_pos;
+			while (true) {
+				cell = &buffer[pos&mask];
+				unsigned long seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+				long diff = (long)(seq-(pos+1));
+				if (diff == 0) {
+					if (__sync_bool_compare_and_swap(&dequeue_pos, pos, pos+1)) {
+						break;
+					}
+					bo.wait();
+				} else if (diff < 0) {
+					return false;
+				}
+				pos = dequeue_pos;
+			}
+			*val = cell->value;
+			__atomic_store_n(&cell->sequence, pos+mask+1, __ATOMIC_RELEASE);
+			return true;
+		}
+		
+};
+
+/////////////////////////////////////////////////////
+/* main */
+
+void test_time () {
+	double tstart = 0.0, ttaken = 0.0;
+	RingQueue q_ring(RING_SIZE);
+	tstart = omp_get_wtime();
+
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_ring.enqueue(i);
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "enqueue time: " << ttaken << endl;
+		
+	usleep(1000);
+
+	tstart = 0.0;
+	ttaken = 0.0;
+	tstart = omp_get_wtime();
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		q_ring.dequeue(&val);
+	}
+	ttaken = omp_get_wtime() - tstart;
+	cout << "dequeue time: " << ttaken << endl;
+}
+
+void test_enqueue_correct () {
+	RingQueue q_ring(RING_SIZE);
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		q_ring.enqueue(i);
+	}
+
+	int count = 0;
+	for (int i = 1;i <= N;i++) {
+		int pop_val;
+		if (!q_ring.dequeue(&pop_val)) {
+			break;
+		}
+		count++;
+		
+		if (correct_check[pop_val] == 0) {
+			cout << "Unseen variable" << endl;
+			return ;
+		}
+		
+		correct_check[pop_val]--;
+		if (correct_check[pop_val] < 0) {
+			cout << "Multiple variable" << endl;
+			return ;
+		}
+		
+	}
+	
+	if (count != N) {
+		cout << "Enqueue number: " << count << " , Sample number: " << N << endl;
+		return ;
+	}
+	cout << "Enqueue Correct" << endl;
+}
+
+void test_dequeue_correct () {
+	RingQueue q_ring(RING_SIZE);
+	for (int i = 1;i <= N;i++) {
+		q_ring.enqueue(i);
+	}
+
+	usleep(1000);
+
+	# pragma omp parallel for 
+	for (int i = 1;i <= N;i++) {
+		int val;
+		if (q_ring.dequeue(&val)) {
+			correct_thread[omp_get_thread_num()].push_back(val);
+		}
+	}
+	
+	int count = 0;
+	for (int i = 0;i < thread_number;i++) {
+		for (size_t j = 0;j < correct_thread[i].size();j++) {
+			count++;
+			int pop_val = correct_thread[i][j];
+			if (correct_check[pop_val] == 0) {
+				cout << "Unseen variable " << pop_val << endl;
+				return ;
+			}
+			correct_check[pop_val]--;
+			if (correct_check[pop_val] < 0) {
+				cout << "Multiple variable" << endl;
+				return ;
+			}
+		}
+	}
+	
+	if (count != N) {
+		cout << "Dequeue number: " << count << " , Sample number: " << N << endl;
+		return ;
+	}
+	
+	cout << "Dequeue Correct" << endl;
+}
+
+// the same workload as test_time once for every backoff strategy
+void test_backoff () {
+	const char *names[] = {"none", "exponential", "proportional"};
+	for (int method = BACKOFF_NONE;method <= BACKOFF_PROP;method++) {
+		double tstart = 0.0, enqueue_time = 0.0, dequeue_time = 0.0;
+		RingQueue q_ring(RING_SIZE);
+		q_ring.set_backoff(method);
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			q_ring.enqueue(i);
+		}
+		enqueue_time = omp_get_wtime() - tstart;
+
+		tstart = omp_get_wtime();
+		# pragma omp parallel for 
+		for (int i = 1;i <= N;i++) {
+			int val;
+			q_ring.dequeue(&val);
+		}
+		dequeue_time = omp_get_wtime() - tstart;
+		cout << names[method] << " backoff, enqueue time: " << enqueue_time << " , dequeue time: " << dequeue_time << endl;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3 || argc > 4) {
+		printf("error argument number\n");
+		return 0;
+	}
+
+	for (int i = 1;i <= N;i++) {
+		correct_check[i] = 1;
+	}
+	
+	thread_number = atoi(argv[1]);
+	correct_thread = new vector<int>[thread_number];
+	int test_method = atoi(argv[2]);
+	backoff_method = (argc > 3) ? atoi(argv[3]) : BACKOFF_EXP;
+
+	omp_set_num_threads(thread_number);
+
+	switch (test_method) {
+		case 1:
+			test_time();
+			break;
+		case 2:
+			test_enqueue_correct();
+			break;
+		case 3:
+			test_dequeue_correct();
+			break;
+		case 4:
+			test_backoff();
+			break;
+		default:
+			printf("error test method\n");
+			return 0;
+	}
+
+	return 0;
+}